@@ -0,0 +1,241 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include "core0/event.h"
+#include "core0/histogram.h"
+#include "core0/timer.h"
+#include "core0/types.h"
+#include "core1/io_ring.hpp"
+#include "core1/transfer_pool.h"
+
+// Benchmarks io_ring throughput and latency, event wake up latency, timer jitter and transfer allocation.
+// Usage: maui_bench [--quick] [--filter <name>] [--out <file.json>]
+namespace {
+	struct bench_options {
+		bool quick = false;
+		std::string filter;
+		std::string out;
+	};
+
+	i64 now_ns() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	const char* mode_name(const core1::buffer_utils::io_ring_mode mode) {
+		switch (mode) {
+			case core1::buffer_utils::io_ring_mode::blocking: return "blocking";
+			case core1::buffer_utils::io_ring_mode::non_blocking: return "non_blocking";
+			default: return "adaptive";
+		}
+	}
+
+	// Collects results as a JSON array of flat objects.
+	class json_report {
+	public:
+		json_report& begin(const std::string& name) {
+			m_out << (m_count++ ? ",\n" : "") << "    {\"name\": \"" << name << "\"";
+			return *this;
+		}
+		json_report& field(const std::string& key, const std::string& value) {
+			m_out << ", \"" << key << "\": \"" << value << "\"";
+			return *this;
+		}
+		json_report& field(const std::string& key, const double value) {
+			m_out << ", \"" << key << "\": " << value;
+			return *this;
+		}
+		json_report& latency(const std::string& key, const core0::histogram_snapshot& h) {
+			m_out << ", \"" << key << "\": {\"count\": " << h.count() << ", \"mean\": " << h.mean() << ", \"p50\": " << h.percentile(50)
+				<< ", \"p99\": " << h.percentile(99) << ", \"p999\": " << h.percentile(99.9) << ", \"max\": " << h.max() << "}";
+			return *this;
+		}
+		void end() {
+			m_out << "}";
+		}
+		std::string str() const {
+			return "{\n  \"benchmarks\": [\n" + m_out.str() + "\n  ]\n}\n";
+		}
+
+	private:
+		std::ostringstream m_out;
+		size_t m_count = 0;
+	};
+
+	// Items travel around a bounded ring, the submitter fills the item and the completer reads it back.
+	template <core1::buffer_utils::io_ring_mode I, core1::buffer_utils::io_ring_queue Q = core1::buffer_utils::io_ring_queue::mpmc>
+	void bench_io_ring(json_report& report, const bench_options& options, const unsigned char num_thr, const size_t item_size) {
+		using ring_type = core1::buffer_utils::io_ring<std::vector<u8>, I, core1::buffer_utils::io_ring_storage::bounded, Q>;
+		constexpr size_t ring_size = 64;
+		ring_type ring(ring_size, num_thr, num_thr);
+		for (typename ring_type::handle h = 0; h < ring.capacity(); h++) ring.slot(h).resize(item_size);
+		ring.enable_stats(true);
+		std::atomic<u64> checksum{0};
+		ring.start(
+			[](std::vector<u8>& item) { std::memset(item.data(), static_cast<int>(item.size()), item.size()); },
+			[&](std::vector<u8>& item) { checksum.fetch_add(item[item.size() - 1], std::memory_order_relaxed); });
+		const auto start_ns = now_ns();
+		std::this_thread::sleep_for(std::chrono::milliseconds(options.quick ? 200 : 2000));
+		ring.stop();
+		const double elapsed_sec = (now_ns() - start_ns) * 1e-9;
+		const auto stats = ring.get_stats();
+		report.begin("io_ring")
+			.field("mode", mode_name(I))
+			.field("queue", Q == core1::buffer_utils::io_ring_queue::spsc ? "spsc" : "mpmc")
+			.field("threads_per_stage", num_thr)
+			.field("item_size", static_cast<double>(item_size))
+			.field("items_per_sec", stats.complete.items / elapsed_sec)
+			.latency("handoff_latency_ns", stats.latency_ns)
+			.end();
+	}
+
+	// Ping pong between two threads, the latency is from set() on one thread until wait() returns on the other.
+	template <typename EVENT>
+	void bench_event(json_report& report, const bench_options& options, const std::string& name) {
+		const size_t iterations = options.quick ? 2000 : 50000;
+		EVENT evt;
+		core0::auto_reset_event ack;
+		std::atomic<i64> set_ns{0};
+		core0::histogram latency;
+		std::thread waiter([&] {
+			for (size_t ii = 0; ii < iterations; ii++) {
+				evt.wait();
+				latency.record(static_cast<u64>(now_ns() - set_ns.load(std::memory_order_acquire)));
+				if constexpr (std::is_same_v<EVENT, core0::manual_reset_event>) evt.reset();
+				ack.set();
+			}
+		});
+		for (size_t ii = 0; ii < iterations; ii++) {
+			set_ns.store(now_ns(), std::memory_order_release);
+			evt.set();
+			ack.wait();
+		}
+		waiter.join();
+		report.begin(name).latency("wake_latency_ns", latency.snapshot()).end();
+	}
+
+	// Records how far each timer tick lands from the previous tick plus the period.
+	void bench_timer(json_report& report, const bench_options& options, const double period_sec) {
+		const size_t ticks = options.quick ? 50 : 1000;
+		const i64 period_ns = static_cast<i64>(period_sec * 1e9);
+		core0::histogram jitter;
+		core0::auto_reset_event done;
+		size_t count = 0;
+		i64 last_ns = 0;
+		core0::timer t;
+		t.start(period_sec, [&] {
+			const auto tick_ns = now_ns();
+			if (count++) jitter.record(static_cast<u64>(std::abs(tick_ns - last_ns - period_ns)));
+			last_ns = tick_ns;
+			if (count == ticks + 1) done.set();
+		});
+		done.wait();
+		t.stop_sync();
+		report.begin("timer").field("period_sec", period_sec).latency("jitter_ns", jitter.snapshot()).end();
+	}
+
+	// Same for the precise mode, which reports its own jitter and overruns.
+	void bench_timer_precise(json_report& report, const bench_options& options, const double period_sec, const size_t spin_usec) {
+		core0::timer t;
+		core0::timer::precise_options precise;
+		precise.spin_usec = spin_usec;
+		t.start_precise(period_sec, [] {}, precise);
+		std::this_thread::sleep_for(std::chrono::milliseconds(options.quick ? 50 : 1000));
+		t.stop_sync();
+		const auto stats = t.get_stats();
+		report.begin("timer_precise")
+			.field("period_sec", period_sec)
+			.field("spin_usec", static_cast<double>(spin_usec))
+			.field("overruns", static_cast<double>(stats.overruns))
+			.latency("jitter_ns", stats.jitter_ns)
+			.end();
+	}
+
+	// Time to get and release a transfer buffer, from the system allocator and from a transfer_pool.
+	void bench_transfer_pool(json_report& report, const bench_options& options, const size_t size) {
+		const size_t iterations = options.quick ? 10000 : 1000000;
+		core1::memory::transfer_pool pool;
+		i64 start_ns = now_ns();
+		for (size_t ii = 0; ii < iterations; ii++) {
+			core1::memory::aligned_transfer<false> transfer(size, 4096);
+			transfer.buffer[0] = static_cast<unsigned char>(ii);
+		}
+		const double malloc_ns = static_cast<double>(now_ns() - start_ns) / static_cast<double>(iterations);
+		start_ns = now_ns();
+		for (size_t ii = 0; ii < iterations; ii++) {
+			auto transfer = pool.acquire(size);
+			transfer.buffer[0] = static_cast<unsigned char>(ii);
+		}
+		const double pool_ns = static_cast<double>(now_ns() - start_ns) / static_cast<double>(iterations);
+		report.begin("transfer_pool")
+			.field("size", static_cast<double>(size))
+			.field("aligned_transfer_ns", malloc_ns)
+			.field("pooled_transfer_ns", pool_ns)
+			.field("hit_rate", pool.get_stats().hit_rate())
+			.end();
+	}
+
+	bool selected(const bench_options& options, const std::string& name) {
+		return options.filter.empty() || name.find(options.filter) != std::string::npos;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	bench_options options;
+	for (int ii = 1; ii < argc; ii++) {
+		const std::string arg = argv[ii];
+		if (arg == "--quick") options.quick = true;
+		else if (arg == "--filter" && ii + 1 < argc) options.filter = argv[++ii];
+		else if (arg == "--out" && ii + 1 < argc) options.out = argv[++ii];
+		else {
+			std::cout << "Usage: maui_bench [--quick] [--filter <name>] [--out <file.json>]" << std::endl;
+			return 1;
+		}
+	}
+
+	json_report report;
+	if (selected(options, "io_ring")) {
+		for (const unsigned char num_thr : {1, 2}) {
+			for (const size_t item_size : {64, 4096, 65536}) {
+				bench_io_ring<core1::buffer_utils::io_ring_mode::blocking>(report, options, num_thr, item_size);
+				bench_io_ring<core1::buffer_utils::io_ring_mode::non_blocking>(report, options, num_thr, item_size);
+				bench_io_ring<core1::buffer_utils::io_ring_mode::adaptive>(report, options, num_thr, item_size);
+				if (num_thr > 1) continue;
+				bench_io_ring<core1::buffer_utils::io_ring_mode::blocking, core1::buffer_utils::io_ring_queue::spsc>(report, options, num_thr, item_size);
+				bench_io_ring<core1::buffer_utils::io_ring_mode::non_blocking, core1::buffer_utils::io_ring_queue::spsc>(report, options, num_thr, item_size);
+				bench_io_ring<core1::buffer_utils::io_ring_mode::adaptive, core1::buffer_utils::io_ring_queue::spsc>(report, options, num_thr, item_size);
+			}
+		}
+	}
+	if (selected(options, "manual_reset_event")) bench_event<core0::manual_reset_event>(report, options, "manual_reset_event");
+	if (selected(options, "auto_reset_event")) bench_event<core0::auto_reset_event>(report, options, "auto_reset_event");
+	if (selected(options, "timer")) bench_timer(report, options, 0.001);
+	if (selected(options, "timer_precise")) {
+		bench_timer_precise(report, options, 0.001, 0);
+		bench_timer_precise(report, options, 0.001, 100);
+	}
+	if (selected(options, "transfer_pool")) {
+		for (const size_t size : {4096, 65536, 1 << 20}) bench_transfer_pool(report, options, size);
+	}
+
+	if (options.out.empty()) {
+		std::cout << report.str();
+	}
+	else {
+		std::ofstream file(options.out);
+		if (!file) {
+			std::cout << "Cannot open " << options.out << std::endl;
+			return 1;
+		}
+		file << report.str();
+	}
+	return 0;
+}
@@ -0,0 +1,293 @@
+#ifndef _COROUTINE_H
+#define _COROUTINE_H
+
+#ifdef __linux__
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "pollable_event.h"
+#include "timer_service.h"
+
+// Coroutine support: device dialogues can be written as sequential code which suspends on events and timers
+// instead of blocking a thread each. All coroutines of a scheduler run on the scheduler thread.
+// Example use:
+// core0::co::task<int> request(port& p, core0::pollable_event& reply) {
+// 	p.send(...);
+// 	co_await reply;
+// 	co_await core0::co::sleep_for(std::chrono::milliseconds(10));
+// 	co_return 42;
+// }
+// core0::co::task<> dialogue(...) { auto value = co_await request(...); ... }
+// core0::co::scheduler s;
+// s.spawn(dialogue(...));
+// s.run();
+namespace core0::co {
+	template <typename T = void>
+	class task;
+
+	namespace detail {
+		// A task starts when it is awaited and resumes its awaiter when it finishes.
+		struct promise_base {
+			std::coroutine_handle<> continuation;
+			std::exception_ptr error;
+
+			struct final_awaiter {
+				bool await_ready() noexcept { return false; }
+				template <typename P>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+					const auto continuation = h.promise().continuation;
+					return continuation ? continuation : std::noop_coroutine();
+				}
+				void await_resume() noexcept {}
+			};
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			final_awaiter final_suspend() noexcept { return {}; }
+			void unhandled_exception() { error = std::current_exception(); }
+		};
+
+		template <typename T>
+		struct promise : promise_base {
+			std::optional<T> value;
+			task<T> get_return_object();
+			void return_value(T v) { value = std::move(v); }
+			T result() {
+				if (error) std::rethrow_exception(error);
+				return std::move(*value);
+			}
+		};
+
+		template <>
+		struct promise<void> : promise_base {
+			task<void> get_return_object();
+			void return_void() {}
+			void result() {
+				if (error) std::rethrow_exception(error);
+			}
+		};
+
+		// Owns a spawned task, it destroys itself when the task is done (an exception escaping it terminates).
+		struct detached {
+			struct promise_type {
+				detached get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+				std::suspend_always initial_suspend() noexcept { return {}; }
+				std::suspend_never final_suspend() noexcept { return {}; }
+				void return_void() {}
+				void unhandled_exception() { std::terminate(); }
+			};
+			std::coroutine_handle<promise_type> handle;
+		};
+	}
+
+	// A lazily started coroutine returning T, awaited by another coroutine or spawned on a scheduler.
+	template <typename T>
+	class task {
+	public:
+		using promise_type = detail::promise<T>;
+
+		task() = default;
+		explicit task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+		task(task&& other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+		task& operator=(task&& other) noexcept {
+			if (this != &other) {
+				if (m_handle) m_handle.destroy();
+				m_handle = std::exchange(other.m_handle, {});
+			}
+			return *this;
+		}
+		task(const task&) = delete;
+		task& operator=(const task&) = delete;
+		~task() {
+			if (m_handle) m_handle.destroy();
+		}
+
+		bool await_ready() const { return !m_handle || m_handle.done(); }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+			m_handle.promise().continuation = awaiter;
+			return m_handle;
+		}
+		T await_resume() { return m_handle.promise().result(); }
+
+	private:
+		std::coroutine_handle<promise_type> m_handle;
+	};
+
+	namespace detail {
+		template <typename T>
+		inline task<T> promise<T>::get_return_object() { return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this)); }
+		inline task<void> promise<void>::get_return_object() { return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this)); }
+
+		inline detached make_detached(task<> t) {
+			co_await t;
+		}
+	}
+
+	// Runs coroutines on the thread which calls run(), suspended coroutines wait in an epoll set (events)
+	// or on a timer_service (sleeps), anything else can resume work on the scheduler thread through post().
+	class scheduler {
+	public:
+		explicit scheduler(std::shared_ptr<timer_service> timers = timer_service::shared()) : m_timers(std::move(timers)) {
+			m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+			epoll_event ev{};
+			ev.events = EPOLLIN;
+			ev.data.ptr = nullptr;
+			epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake.fd(), &ev);
+		}
+		~scheduler() {
+			if (m_epoll_fd >= 0) close(m_epoll_fd);
+		}
+		scheduler(const scheduler&) = delete;
+		scheduler& operator=(const scheduler&) = delete;
+
+		// The scheduler running on the calling thread (nullptr outside of run()).
+		static scheduler*& current() {
+			static thread_local scheduler* current = nullptr;
+			return current;
+		}
+
+		// Starts a task on the scheduler thread (can be called from any thread).
+		void spawn(task<> t) {
+			auto handle = detail::make_detached(std::move(t)).handle;
+			this->post([handle] { handle.resume(); });
+		}
+
+		// Runs work on the scheduler thread (can be called from any thread).
+		void post(std::function<void()> work) {
+			{
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_ready.push_back(std::move(work));
+			}
+			if (current() != this) m_wake.set();
+		}
+		void post(const std::coroutine_handle<> handle) {
+			this->post([handle] { handle.resume(); });
+		}
+
+		// Runs until stop() is called. Coroutines which are still suspended at that point are not resumed.
+		void run() {
+			current() = this;
+			m_run = true;
+			std::vector<std::function<void()>> work;
+			epoll_event events[64];
+			while (m_run) {
+				{
+					std::lock_guard<std::mutex> lck(m_mtx);
+					work.assign(std::make_move_iterator(m_ready.begin()), std::make_move_iterator(m_ready.end()));
+					m_ready.clear();
+				}
+				for (auto& w : work) w();
+				work.clear();
+				bool idle;
+				{
+					std::lock_guard<std::mutex> lck(m_mtx);
+					idle = m_ready.empty();
+				}
+				const int count = epoll_wait(m_epoll_fd, events, 64, idle && m_run ? -1 : 0);
+				for (int ii = 0; ii < count; ii++) {
+					if (!events[ii].data.ptr) m_wake.reset();
+					else static_cast<fd_waiter*>(events[ii].data.ptr)->on_ready();
+				}
+			}
+			current() = nullptr;
+		}
+
+		// Stops run() (can be called from any thread, including from a coroutine).
+		void stop() {
+			m_run = false;
+			m_wake.set();
+		}
+
+		timer_service& timers() { return *m_timers; }
+
+		// Waits in the epoll set until a pollable event is signaled, then consumes it (see pollable_event::try_consume()).
+		struct fd_waiter {
+			pollable_event& event;
+			std::coroutine_handle<> handle = {};
+			scheduler* sched = nullptr;
+			int fd = -1;
+
+			bool await_ready() { return event.try_consume(); }
+			bool await_suspend(std::coroutine_handle<> h) {
+				handle = h;
+				sched = scheduler::current();
+				fd = event.fd();
+				epoll_event ev{};
+				ev.events = EPOLLIN | EPOLLONESHOT;
+				ev.data.ptr = this;
+				if (epoll_ctl(sched->m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+					// Another coroutine of this scheduler waits on the same event, register a duplicate of its descriptor.
+					if (errno != EEXIST || (fd = dup(event.fd())) < 0 || epoll_ctl(sched->m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+						this->release();
+						return false;
+					}
+				}
+				return true;
+			}
+			void await_resume() {}
+
+			void on_ready() {
+				if (!event.try_consume()) {
+					epoll_event ev{};
+					ev.events = EPOLLIN | EPOLLONESHOT;
+					ev.data.ptr = this;
+					epoll_ctl(sched->m_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+					return;
+				}
+				this->release();
+				handle.resume();
+			}
+			void release() {
+				if (fd < 0) return;
+				epoll_ctl(sched->m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+				if (fd != event.fd()) close(fd);
+				fd = -1;
+			}
+		};
+
+	private:
+		std::shared_ptr<timer_service> m_timers;
+		int m_epoll_fd = -1;
+		pollable_event m_wake;
+		std::mutex m_mtx;
+		std::deque<std::function<void()>> m_ready;
+		std::atomic<bool> m_run{false};
+	};
+
+	// Resumes the awaiting coroutine on its scheduler after a delay (driven by the scheduler's timer_service).
+	struct sleep_awaiter {
+		std::chrono::microseconds delay;
+		bool await_ready() const { return delay.count() <= 0; }
+		void await_suspend(std::coroutine_handle<> handle) {
+			auto* sched = scheduler::current();
+			sched->timers().add(static_cast<size_t>(delay.count()), [sched, handle] { sched->post(handle); });
+		}
+		void await_resume() {}
+	};
+
+	template <typename Rep, typename Period>
+	inline sleep_awaiter sleep_for(const std::chrono::duration<Rep, Period>& delay) {
+		return {std::chrono::ceil<std::chrono::microseconds>(delay)};
+	}
+}
+
+namespace core0 {
+	// co_await evt suspends until a pollable event is signaled (auto reset events are consumed).
+	inline co::scheduler::fd_waiter operator co_await(pollable_event& event) {
+		return {event};
+	}
+}
+
+#endif
+#endif
@@ -6,8 +6,145 @@
 #include <condition_variable>
 #include <chrono>
 #include <atomic>
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 namespace core0 {
+#ifdef __linux__
+	namespace detail {
+		// Blocks while *addr == expected, for up to timeout_ns (relative, monotonic) if timeout_ns >= 0.
+		inline void futex_wait(std::atomic<unsigned>& addr, const unsigned expected, const long long timeout_ns = -1) {
+			static_assert(sizeof(std::atomic<unsigned>) == sizeof(unsigned));
+			timespec ts;
+			if (timeout_ns >= 0) {
+				ts.tv_sec = static_cast<time_t>(timeout_ns / 1000000000);
+				ts.tv_nsec = static_cast<long>(timeout_ns % 1000000000);
+			}
+			syscall(SYS_futex, reinterpret_cast<unsigned*>(&addr), FUTEX_WAIT_PRIVATE, expected, timeout_ns >= 0 ? &ts : nullptr, nullptr, 0);
+		}
+		// Same as futex_wait, but with an absolute CLOCK_MONOTONIC deadline (which is what steady_clock is on Linux).
+		inline void futex_wait_until(std::atomic<unsigned>& addr, const unsigned expected, const std::chrono::steady_clock::time_point& deadline) {
+			const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+			timespec ts;
+			ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+			ts.tv_nsec = static_cast<long>(ns % 1000000000);
+			syscall(SYS_futex, reinterpret_cast<unsigned*>(&addr), FUTEX_WAIT_BITSET_PRIVATE, expected, &ts, nullptr, FUTEX_BITSET_MATCH_ANY);
+		}
+		inline void futex_wake(std::atomic<unsigned>& addr, const int count) {
+			syscall(SYS_futex, reinterpret_cast<unsigned*>(&addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+		}
+
+		// Nanoseconds left until a steady clock deadline (never negative).
+		inline long long remaining_ns(const std::chrono::steady_clock::time_point& deadline) {
+			const auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+			return left > 0 ? left : 0;
+		}
+	}
+
+	// Futex based events: set() and reset() are a single atomic operation unless somebody is actually waiting,
+	// and timeouts are measured on the monotonic clock.
+	class manual_reset_event {
+	public:
+		operator bool() const { return this->test(); }
+
+		void wait() {
+			if (this->test()) { return; }
+			this->waiters.fetch_add(1);
+			while (!this->test()) detail::futex_wait(this->state, reset_);
+			this->waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		// Returns true, if the event has been signaled, false if timeout.
+		// A waiter which times out unregisters, so later set() calls do not wake for nobody.
+		bool wait(const std::size_t timeout_usec) {
+			if (this->test()) { return true; }
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usec);
+			this->waiters.fetch_add(1);
+			bool rv;
+			while (!(rv = this->test())) {
+				const auto left_ns = detail::remaining_ns(deadline);
+				if (!left_ns) break;
+				detail::futex_wait(this->state, reset_, left_ns);
+			}
+			this->waiters.fetch_sub(1, std::memory_order_relaxed);
+			return rv;
+		}
+
+		// Returns true, if the event has been signaled, false if the (absolute, monotonic) deadline passed.
+		bool wait_until(const std::chrono::steady_clock::time_point& deadline) {
+			if (this->test()) { return true; }
+			this->waiters.fetch_add(1);
+			bool rv;
+			while (!(rv = this->test())) {
+				if (std::chrono::steady_clock::now() >= deadline) break;
+				detail::futex_wait_until(this->state, reset_, deadline);
+			}
+			this->waiters.fetch_sub(1, std::memory_order_relaxed);
+			return rv;
+		}
+
+		// As in auto_reset_event, either the waiter sees the flag or set() sees the waiter.
+		void set() {
+			this->state.store(signaled);
+			if (this->waiters.load()) detail::futex_wake(this->state, INT_MAX);
+		}
+
+		void reset() {
+			this->state.store(reset_, std::memory_order_relaxed);
+		}
+
+	private:
+		static constexpr unsigned reset_ = 0;
+		static constexpr unsigned signaled = 1;
+		std::atomic<unsigned> state{reset_};
+		std::atomic<unsigned> waiters{0};
+		bool test() const { return this->state.load() == signaled; }
+	};
+
+	class auto_reset_event {
+	public:
+		operator bool() { return this->test_and_clear(); }
+
+		void wait() {
+			if (this->test_and_clear()) { return; }
+			this->waiters.fetch_add(1);
+			while (!this->test_and_clear()) detail::futex_wait(this->signaled, 0);
+			this->waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		// Returns true, if the event has been signaled, false if timeout.
+		bool wait(const std::size_t timeout_usec) {
+			if (this->test_and_clear()) { return true; }
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usec);
+			this->waiters.fetch_add(1);
+			bool rv;
+			while (!(rv = this->test_and_clear())) {
+				const auto left_ns = detail::remaining_ns(deadline);
+				if (!left_ns) break;
+				detail::futex_wait(this->signaled, 0, left_ns);
+			}
+			this->waiters.fetch_sub(1, std::memory_order_relaxed);
+			return rv;
+		}
+
+		// Waiters register before they check the flag and set() checks for waiters after it raised the flag,
+		// so either the waiter sees the flag or set() sees the waiter.
+		void set() {
+			this->signaled.store(1);
+			if (this->waiters.load()) detail::futex_wake(this->signaled, 1);
+		}
+
+	private:
+		std::atomic<unsigned> signaled{0};
+		std::atomic<unsigned> waiters{0};
+		bool test_and_clear() { return this->signaled.load(std::memory_order_relaxed) && this->signaled.exchange(0, std::memory_order_acquire); }
+	};
+#else
 	class manual_reset_event {
 	public:
 		operator bool() const { return this->test(); }
@@ -21,11 +158,18 @@ namespace core0 {
 		// Returns true, if the event has been signaled, false if timeout.
 		bool wait(const std::size_t timeout_usec) {
 			if (this->test()) { return true; }  // Optimization to avoid lock.
-			const auto wait_until = std::chrono::system_clock::now() + std::chrono::microseconds(timeout_usec);
+			const auto wait_until = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usec);
 			std::unique_lock<std::mutex> lck(this->mtx);
 			return this->cv.wait_until(lck, wait_until, [this]() { return this->test(); });
 		}
 
+		// Returns true, if the event has been signaled, false if the (absolute, monotonic) deadline passed.
+		bool wait_until(const std::chrono::steady_clock::time_point& deadline) {
+			if (this->test()) { return true; }  // Optimization to avoid lock.
+			std::unique_lock<std::mutex> lck(this->mtx);
+			return this->cv.wait_until(lck, deadline, [this]() { return this->test(); });
+		}
+
 		void set() {
 			{
 				std::lock_guard<std::mutex> lck(this->mtx);
@@ -42,7 +186,7 @@ namespace core0 {
 	private:
 		std::condition_variable cv;
 		std::mutex mtx;
-		bool signaled = false;
+		std::atomic<bool> signaled{false};
 		bool test() const { return this->signaled; }
 	};
 
@@ -59,7 +203,7 @@ namespace core0 {
 		// Returns true, if the event has been signaled, false if timeout.
 		bool wait(const std::size_t timeout_usec) {
 			if (this->test_and_clear()) { return true; } // Optimization to avoid lock.
-			const auto wait_until = std::chrono::system_clock::now() + std::chrono::microseconds(timeout_usec);
+			const auto wait_until = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usec);
 			std::unique_lock<std::mutex> lck(this->mtx);
 			return this->cv.wait_until(lck, wait_until, [this]() { return this->test_and_clear(); });
 		}
@@ -78,6 +222,7 @@ namespace core0 {
 		std::atomic<bool> signaled{false};
 		bool test_and_clear() { return this->signaled.exchange(false); }
 	};
+#endif
 }
 
 #endif
@@ -0,0 +1,342 @@
+#ifndef _EXECUTOR_H
+#define _EXECUTOR_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include "spin_wait.h"
+#include "thread_utils.h"
+#include "types.h"
+
+namespace core0 {
+	namespace detail {
+		// Chase-Lev work stealing deque (the C11 formulation of Le et al.): the owner pushes and pops at the bottom,
+		// any other thread steals from the top. Only a pop racing a steal for the last item needs a CAS.
+		// The array grows when full, retired arrays are kept until the deque is destroyed since thieves may still read them.
+		template <typename T>
+		class chase_lev_deque {
+		public:
+			explicit chase_lev_deque(const i64 capacity = 256) {
+				m_arrays.push_back(std::make_unique<ring>(std::max<i64>(capacity, 2)));
+				m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+			}
+
+			// Owner only.
+			void push(const T item) {
+				const i64 b = m_bottom.load(std::memory_order_relaxed);
+				const i64 t = m_top.load(std::memory_order_acquire);
+				ring* a = m_array.load(std::memory_order_relaxed);
+				if (b - t > a->capacity - 1) a = this->grow(a, b, t);
+				a->put(b, item);
+				m_bottom.store(b + 1, std::memory_order_release);
+			}
+			bool pop(T& item) {
+				const i64 b = m_bottom.load(std::memory_order_relaxed) - 1;
+				ring* a = m_array.load(std::memory_order_relaxed);
+				m_bottom.store(b, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				i64 t = m_top.load(std::memory_order_relaxed);
+				if (t > b) {
+					m_bottom.store(b + 1, std::memory_order_relaxed);
+					return false;
+				}
+				item = a->get(b);
+				if (t == b) {
+					const bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+					m_bottom.store(b + 1, std::memory_order_relaxed);
+					return won;
+				}
+				return true;
+			}
+
+			// Any thread.
+			bool steal(T& item) {
+				i64 t = m_top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				const i64 b = m_bottom.load(std::memory_order_acquire);
+				if (t >= b) return false;
+				ring* a = m_array.load(std::memory_order_acquire);
+				item = a->get(t);
+				return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			}
+			bool empty() const {
+				return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+			}
+
+		private:
+			struct ring {
+				explicit ring(const i64 capacity) : capacity(capacity), items(std::make_unique<std::atomic<T>[]>(capacity)) {}
+				void put(const i64 index, const T item) { items[index & (capacity - 1)].store(item, std::memory_order_relaxed); }
+				T get(const i64 index) const { return items[index & (capacity - 1)].load(std::memory_order_relaxed); }
+				const i64 capacity;
+				std::unique_ptr<std::atomic<T>[]> items;
+			};
+
+			ring* grow(ring* a, const i64 b, const i64 t) {
+				m_arrays.push_back(std::make_unique<ring>(a->capacity * 2));
+				ring* bigger = m_arrays.back().get();
+				for (i64 ii = t; ii < b; ii++) bigger->put(ii, a->get(ii));
+				m_array.store(bigger, std::memory_order_release);
+				return bigger;
+			}
+
+			alignas(64) std::atomic<i64> m_top{0};
+			alignas(64) std::atomic<i64> m_bottom{0};
+			std::atomic<ring*> m_array;
+			std::vector<std::unique_ptr<ring>> m_arrays;
+		};
+	}
+
+	// A work stealing thread pool: each worker runs the tasks it queued itself first (LIFO, cache warm),
+	// then tasks posted from outside the pool, then steals the oldest tasks of the other workers.
+	// Idle workers spin briefly and then sleep, so an idle pool costs nothing.
+	// Example use:
+	// core0::executor pool;                        // one worker per cpu
+	// pool.post([](){ work(); });
+	// pool.bulk(1000, [](size_t ii){ work(ii); }, [](){ done(); });
+	class executor {
+	public:
+		struct options {
+			options() {}
+			unsigned num_threads = 0;                // 0 for one worker per cpu.
+			std::vector<std::vector<int>> cpus;      // Worker ii is pinned to cpus[ii % cpus.size()], empty for no pinning.
+			std::string name;                        // Workers are named <name><ii>.
+		};
+
+		explicit executor(const options& options = {}) {
+			unsigned num_threads = options.num_threads ? options.num_threads : std::max(1u, std::thread::hardware_concurrency());
+			m_workers.reserve(num_threads);
+			for (unsigned ii = 0; ii < num_threads; ii++) m_workers.push_back(std::make_unique<worker>());
+			for (unsigned ii = 0; ii < num_threads; ii++) {
+				m_workers[ii]->thread = std::thread([this, ii, options] {
+					if (!options.cpus.empty()) this_thread::set_affinity(options.cpus[ii % options.cpus.size()]);
+					if (!options.name.empty()) this_thread::set_name(options.name + std::to_string(ii));
+					this->run(ii);
+				});
+			}
+		}
+
+		// Runs the tasks which are already queued and then joins the workers.
+		~executor() {
+			{
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_run = false;
+			}
+			m_cv.notify_all();
+			for (auto& w : m_workers) {
+				if (w->thread.joinable()) w->thread.join();
+			}
+		}
+		executor(const executor&) = delete;
+		executor& operator=(const executor&) = delete;
+
+		size_t size() const { return m_workers.size(); }
+
+		// True when called from one of the pool workers.
+		bool running_in_this_thread() const { return current().pool == this; }
+
+		// Queues a task, it never runs inline. Tasks posted from a worker go to its own deque, where idle workers can steal them.
+		void post(std::function<void()> fn) {
+			auto* t = make_task(std::move(fn));
+			const auto& cur = current();
+			if (cur.pool == this) {
+				m_workers[cur.index]->deque.push(t);
+			}
+			else {
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_injected.push_back(t);
+				m_num_injected.store(m_injected.size(), std::memory_order_relaxed);
+			}
+			this->wake(1);
+		}
+
+		// Queues a continuation of the running task: from a worker it runs on the same worker once the current task returns
+		// (it is not stolen, so it stays cache warm and in order), from any other thread it is the same as post().
+		void defer(std::function<void()> fn) {
+			const auto& cur = current();
+			if (cur.pool != this) return this->post(std::move(fn));
+			m_workers[cur.index]->continuations.push_back(make_task(std::move(fn)));
+		}
+
+		// Runs fn(ii) for ii in [0, count) across the pool, then calls on_done (on the worker which finished last).
+		// Indices are handed out dynamically, so uneven work balances itself.
+		void bulk(const size_t count, std::function<void(size_t)> fn, std::function<void()> on_done = nullptr) {
+			if (!count) {
+				if (on_done) on_done();
+				return;
+			}
+			struct bulk_state {
+				std::function<void(size_t)> fn;
+				std::function<void()> on_done;
+				size_t count;
+				std::atomic<size_t> next{0};
+				std::atomic<size_t> done{0};
+			};
+			auto state = std::make_shared<bulk_state>();
+			state->fn = std::move(fn);
+			state->on_done = std::move(on_done);
+			state->count = count;
+			const size_t num_tasks = std::min(count, m_workers.size());
+			std::vector<task*> tasks(num_tasks);
+			for (auto& t : tasks) {
+				t = make_task([state] {
+					for (size_t ii; (ii = state->next.fetch_add(1, std::memory_order_relaxed)) < state->count;) {
+						state->fn(ii);
+						if (state->done.fetch_add(1, std::memory_order_acq_rel) + 1 == state->count && state->on_done) state->on_done();
+					}
+				});
+			}
+			{
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_injected.insert(m_injected.end(), tasks.begin(), tasks.end());
+				m_num_injected.store(m_injected.size(), std::memory_order_relaxed);
+			}
+			this->wake(num_tasks);
+		}
+
+		// Adapts the pool to the post function of timer_service::options, serialport::options etc.
+		std::function<void(std::function<void()>)> poster() {
+			return [this](std::function<void()> fn) { this->post(std::move(fn)); };
+		}
+
+	private:
+		struct task {
+			std::function<void()> fn;
+		};
+
+		// Task nodes are recycled through a small cache per thread: a worker keeps the nodes of the tasks it ran,
+		// so posting from a worker does not go to the allocator for the node.
+		struct task_cache {
+			std::vector<task*> nodes;
+			~task_cache() {
+				for (auto* t : nodes) delete t;
+			}
+		};
+		static task_cache& task_nodes() {
+			static thread_local task_cache cache;
+			return cache;
+		}
+		static task* make_task(std::function<void()>&& fn) {
+			auto& nodes = task_nodes().nodes;
+			if (nodes.empty()) return new task{std::move(fn)};
+			task* t = nodes.back();
+			nodes.pop_back();
+			t->fn = std::move(fn);
+			return t;
+		}
+		static void recycle(task* t) {
+			t->fn = nullptr;
+			auto& nodes = task_nodes().nodes;
+			if (nodes.size() < 256) nodes.push_back(t);
+			else delete t;
+		}
+		struct worker {
+			detail::chase_lev_deque<task*> deque;
+			std::deque<task*> continuations;
+			std::thread thread;
+		};
+		struct worker_id {
+			const executor* pool = nullptr;
+			size_t index = 0;
+		};
+
+		static worker_id& current() {
+			static thread_local worker_id id;
+			return id;
+		}
+
+		// Producers publish the task before they look for sleepers and sleepers register before they look for tasks,
+		// so a task is never left behind while every worker sleeps.
+		void wake(const size_t count) {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!m_sleepers.load(std::memory_order_relaxed)) return;
+			std::lock_guard<std::mutex> lck(m_mtx);
+			if (count > 1) m_cv.notify_all();
+			else m_cv.notify_one();
+		}
+
+		task* take(const size_t index) {
+			worker& self = *m_workers[index];
+			task* t = nullptr;
+			if (!self.continuations.empty()) {
+				t = self.continuations.front();
+				self.continuations.pop_front();
+				return t;
+			}
+			if (self.deque.pop(t)) return t;
+
+			// The lock is only taken when there is something to take, so spinning workers do not serialize on it
+			// (a task injected meanwhile is seen by the check under the lock before parking).
+			if (m_num_injected.load(std::memory_order_relaxed)) {
+				std::lock_guard<std::mutex> lck(m_mtx);
+				if (!m_injected.empty()) {
+					t = m_injected.front();
+					m_injected.pop_front();
+					m_num_injected.store(m_injected.size(), std::memory_order_relaxed);
+					return t;
+				}
+			}
+			for (size_t ii = 1; ii < m_workers.size(); ii++) {
+				if (m_workers[(index + ii) % m_workers.size()]->deque.steal(t)) return t;
+			}
+			return nullptr;
+		}
+
+		bool has_work() {
+			if (!m_injected.empty()) return true;
+			for (const auto& w : m_workers) {
+				if (!w->deque.empty()) return true;
+			}
+			return false;
+		}
+
+		void run(const size_t index) {
+			current() = {this, index};
+			spin_wait_policy policy;
+			policy.spin_iterations = 64;
+			policy.yield_iterations = 16;
+			while (true) {
+				task* t = this->take(index);
+				for (unsigned ii = 0; !t && ii < policy.spin_iterations + policy.yield_iterations; ii++) {
+					if (ii < policy.spin_iterations) cpu_relax();
+					else std::this_thread::yield();
+					t = this->take(index);
+				}
+				if (t) {
+					t->fn();
+					recycle(t);
+					continue;
+				}
+				std::unique_lock<std::mutex> lck(m_mtx);
+				m_sleepers.fetch_add(1);
+				if (!this->has_work()) {
+					if (!m_run) {
+						m_sleepers.fetch_sub(1);
+						break;
+					}
+					m_cv.wait_for(lck, std::chrono::milliseconds(100));
+				}
+				m_sleepers.fetch_sub(1);
+			}
+			current() = {};
+		}
+
+		std::vector<std::unique_ptr<worker>> m_workers;
+		std::deque<task*> m_injected;
+		std::atomic<size_t> m_num_injected{0};  // Mirrors m_injected.size() for the lock free check in take().
+		std::mutex m_mtx;
+		std::condition_variable m_cv;
+		std::atomic<unsigned> m_sleepers{0};
+		bool m_run = true;
+	};
+}
+
+#endif
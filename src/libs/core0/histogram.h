@@ -0,0 +1,105 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <atomic>
+#include <array>
+#include <bit>
+#include <algorithm>
+#include "types.h"
+
+namespace core0 {
+	// HDR style log-linear bucketing of u64 values (e.g. latencies in nanoseconds):
+	// each power of two is split into 16 linear sub buckets, so any value is reported within 6.25% of its actual value
+	// using a fixed number of buckets and no allocation.
+	struct histogram_buckets {
+		static constexpr unsigned sub_bucket_bits = 4;
+		static constexpr unsigned sub_buckets = 1u << sub_bucket_bits;
+		static constexpr unsigned num_buckets = (65 - sub_bucket_bits) * sub_buckets;
+
+		static unsigned index_of(const u64 value) {
+			if (value < sub_buckets) return static_cast<unsigned>(value);
+			const unsigned shift = static_cast<unsigned>(std::bit_width(value)) - 1 - sub_bucket_bits;
+			return (shift + 1) * sub_buckets + static_cast<unsigned>((value >> shift) - sub_buckets);
+		}
+
+		// The lowest value which falls into a bucket.
+		static u64 lowest_of(const unsigned index) {
+			if (index < sub_buckets) return index;
+			const unsigned shift = index / sub_buckets - 1;
+			return static_cast<u64>(sub_buckets + index % sub_buckets) << shift;
+		}
+	};
+
+	// A plain copy of a histogram which can be inspected and merged.
+	class histogram_snapshot {
+	public:
+		u64 count() const { return m_count; }
+		u64 max() const { return m_max; }
+		double mean() const { return m_count ? static_cast<double>(m_sum) / m_count : 0.0; }
+		u64 bucket(const unsigned index) const { return m_buckets[index]; }
+
+		// Returns the value at a percentile (0 - 100), reported as the lowest value of its bucket.
+		u64 percentile(const double p) const {
+			if (!m_count) return 0;
+			const u64 rank = std::max<u64>(1, static_cast<u64>(p / 100.0 * m_count + 0.5));
+			u64 seen = 0;
+			for (unsigned ii = 0; ii < histogram_buckets::num_buckets; ii++) {
+				seen += m_buckets[ii];
+				if (seen >= rank) return std::min(histogram_buckets::lowest_of(ii), m_max);
+			}
+			return m_max;
+		}
+
+		histogram_snapshot& operator+=(const histogram_snapshot& other) {
+			for (unsigned ii = 0; ii < histogram_buckets::num_buckets; ii++) m_buckets[ii] += other.m_buckets[ii];
+			m_count += other.m_count;
+			m_sum += other.m_sum;
+			m_max = std::max(m_max, other.m_max);
+			return *this;
+		}
+
+	private:
+		friend class histogram;
+		std::array<u64, histogram_buckets::num_buckets> m_buckets{};
+		u64 m_count = 0;
+		u64 m_sum = 0;
+		u64 m_max = 0;
+	};
+
+	// Recording is lock free and safe from any thread, it is cheapest when every thread records to its own histogram.
+	// A snapshot can be taken from another thread at any time (it is consistent per bucket, not across buckets).
+	class histogram {
+	public:
+		void record(const u64 value) {
+			m_buckets[histogram_buckets::index_of(value)].fetch_add(1, std::memory_order_relaxed);
+			m_count.fetch_add(1, std::memory_order_relaxed);
+			m_sum.fetch_add(value, std::memory_order_relaxed);
+			u64 cur_max = m_max.load(std::memory_order_relaxed);
+			while (value > cur_max && !m_max.compare_exchange_weak(cur_max, value, std::memory_order_relaxed)) {}
+		}
+
+		histogram_snapshot snapshot() const {
+			histogram_snapshot snapshot;
+			for (unsigned ii = 0; ii < histogram_buckets::num_buckets; ii++) snapshot.m_buckets[ii] = m_buckets[ii].load(std::memory_order_relaxed);
+			snapshot.m_count = m_count.load(std::memory_order_relaxed);
+			snapshot.m_sum = m_sum.load(std::memory_order_relaxed);
+			snapshot.m_max = m_max.load(std::memory_order_relaxed);
+			return snapshot;
+		}
+
+		void clear() {
+			for (auto& bucket : m_buckets) bucket.store(0, std::memory_order_relaxed);
+			m_count = 0;
+			m_sum = 0;
+			m_max = 0;
+		}
+
+	private:
+		std::array<std::atomic<u64>, histogram_buckets::num_buckets> m_buckets{};
+		std::atomic<u64> m_count{0};
+		std::atomic<u64> m_sum{0};
+		std::atomic<u64> m_max{0};
+	};
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _MPSC_QUEUE_H
+#define _MPSC_QUEUE_H
+
+#include <atomic>
+#include <utility>
+
+namespace core0 {
+	// Unbounded lock free queue for any number of producer threads and one consumer thread (Vyukov's intrusive MPSC queue).
+	// A push is one exchange and one store, wait free. A pop never blocks, but it can miss an item
+	// whose push is half way through (it is seen by the next pop), so pair the queue with a count or a wake up if that matters.
+	// T must be default constructible.
+	// Example use:
+	// core0::mpsc_queue<msg> q;
+	// q.push(m);                    // any thread
+	// while (q.try_pop(m)) ...      // consumer thread
+	template <typename T>
+	class mpsc_queue {
+	public:
+		mpsc_queue() : m_head(&m_stub), m_tail(&m_stub) {}
+		~mpsc_queue() {
+			T item;
+			while (this->try_pop(item)) {}
+		}
+		mpsc_queue(const mpsc_queue&) = delete;
+		mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+		// Producer side (any thread).
+		void push(T item) {
+			this->push_node(new node(std::move(item)));
+		}
+
+		// Consumer side.
+		bool try_pop(T& item) {
+			node* tail = m_tail;
+			node* next = tail->next.load(std::memory_order_acquire);
+			if (tail == &m_stub) {
+				if (!next) return false;
+				m_tail = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (!next) {
+				// tail is the last item, unless a push is in progress. Put the stub behind it, so tail can be taken.
+				if (tail != m_head.load(std::memory_order_acquire)) return false;
+				m_stub.next.store(nullptr, std::memory_order_relaxed);
+				this->push_node(&m_stub);
+				next = tail->next.load(std::memory_order_acquire);
+				if (!next) return false;
+			}
+			m_tail = next;
+			item = std::move(tail->value);
+			delete tail;
+			return true;
+		}
+		bool empty() const {
+			return m_tail->next.load(std::memory_order_acquire) == nullptr && m_head.load(std::memory_order_acquire) == m_tail;
+		}
+
+	private:
+		struct node {
+			node() {}
+			explicit node(T&& value) : value(std::move(value)) {}
+			std::atomic<node*> next{nullptr};
+			T value;
+		};
+
+		void push_node(node* n) {
+			node* prev = m_head.exchange(n, std::memory_order_acq_rel);
+			prev->next.store(n, std::memory_order_release);
+		}
+
+		alignas(64) std::atomic<node*> m_head;
+		alignas(64) node* m_tail;
+		node m_stub;
+	};
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef _POLLABLE_EVENT_H
+#define _POLLABLE_EVENT_H
+
+#ifdef __linux__
+#include <chrono>
+#include <vector>
+#include <initializer_list>
+#include <cerrno>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "types.h"
+
+namespace core0 {
+	// An event backed by an eventfd, so a thread can wait on several of them at once (wait_any / wait_all)
+	// or register fd() in an epoll set or an asio io_context (asio::posix::stream_descriptor) next to other descriptors.
+	// The descriptor is readable while the event is signaled.
+	// Use manual_reset_event / auto_reset_event where a single event is waited on, they are cheaper.
+	// Example use:
+	// core0::pollable_event stop(true), data;
+	// switch (core0::wait_any({&stop, &data}, 1000)) { case 0: ...; case 1: ...; default: timeout }
+	class pollable_event {
+	public:
+		explicit pollable_event(const bool manual_reset = false) : m_manual_reset(manual_reset) {
+			m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		}
+		~pollable_event() {
+			if (m_fd >= 0) close(m_fd);
+		}
+		pollable_event(const pollable_event&) = delete;
+		pollable_event& operator=(const pollable_event&) = delete;
+
+		// The eventfd, or -1 if it could not be created.
+		int fd() const { return m_fd; }
+		bool is_manual_reset() const { return m_manual_reset; }
+
+		// Checks the event, an auto reset event is consumed by a successful check.
+		operator bool() { return this->try_consume(); }
+
+		void set() {
+			const u64 one = 1;
+			while (write(m_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+		}
+
+		void reset() {
+			u64 count;
+			while (read(m_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+		}
+
+		void wait() {
+			while (!this->wait_readable(-1) || !this->try_consume()) {}
+		}
+
+		// Returns true, if the event has been signaled, false if timeout.
+		bool wait(const std::size_t timeout_usec) {
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usec);
+			while (true) {
+				if (this->try_consume()) return true;
+				const auto left = deadline - std::chrono::steady_clock::now();
+				if (left <= std::chrono::steady_clock::duration::zero()) return false;
+				this->wait_readable(std::chrono::duration_cast<std::chrono::nanoseconds>(left).count());
+			}
+		}
+
+		// A manual reset event is consumed by observing it signaled, an auto reset event by draining its counter
+		// (which fails if another waiter drained it first).
+		bool try_consume() {
+			if (m_manual_reset) {
+				pollfd pfd{m_fd, POLLIN, 0};
+				return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+			}
+			u64 count;
+			return read(m_fd, &count, sizeof(count)) == sizeof(count);
+		}
+
+	private:
+		bool wait_readable(const i64 timeout_ns) {
+			pollfd pfd{m_fd, POLLIN, 0};
+			timespec ts{static_cast<time_t>(timeout_ns / 1000000000), static_cast<long>(timeout_ns % 1000000000)};
+			return ppoll(&pfd, 1, timeout_ns < 0 ? nullptr : &ts, nullptr) > 0;
+		}
+
+		int m_fd = -1;
+		const bool m_manual_reset;
+	};
+
+	namespace detail {
+		// Polls the events until the deadline (a negative timeout waits forever), returns false on timeout.
+		inline bool poll_events(std::vector<pollfd>& fds, const std::chrono::steady_clock::time_point& deadline, const bool forever) {
+			timespec ts{};
+			if (!forever) {
+				const auto left_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+				if (left_ns <= 0) return false;
+				ts = {static_cast<time_t>(left_ns / 1000000000), static_cast<long>(left_ns % 1000000000)};
+			}
+			int rv;
+			while ((rv = ppoll(fds.data(), fds.size(), forever ? nullptr : &ts, nullptr)) < 0 && errno == EINTR) {}
+			return rv > 0;
+		}
+	}
+
+	// Waits until any of the events is signaled and consumes it, returns its index or -1 on timeout.
+	// A negative timeout waits forever.
+	inline int wait_any(const std::vector<pollable_event*>& events, const i64 timeout_usec = -1) {
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usec);
+		std::vector<pollfd> fds(events.size());
+		for (size_t ii = 0; ii < events.size(); ii++) fds[ii] = {events[ii]->fd(), POLLIN, 0};
+		while (true) {
+			for (size_t ii = 0; ii < events.size(); ii++) {
+				if (events[ii]->try_consume()) return static_cast<int>(ii);
+			}
+			if (!detail::poll_events(fds, deadline, timeout_usec < 0)) {
+				if (timeout_usec >= 0 && std::chrono::steady_clock::now() >= deadline) return -1;
+			}
+		}
+	}
+	inline int wait_any(std::initializer_list<pollable_event*> events, const i64 timeout_usec = -1) {
+		return wait_any(std::vector<pollable_event*>(events), timeout_usec);
+	}
+
+	// Waits until all of the events were signaled, returns false on timeout.
+	// Events are consumed one by one as they become signaled (not atomically),
+	// auto reset events which were consumed are set back if the wait times out, so their signal is not lost.
+	inline bool wait_all(const std::vector<pollable_event*>& events, const i64 timeout_usec = -1) {
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usec);
+		std::vector<pollable_event*> pending(events);
+		std::vector<pollable_event*> consumed;
+		std::vector<pollfd> fds;
+		while (true) {
+			for (size_t ii = 0; ii < pending.size();) {
+				if (pending[ii]->try_consume()) {
+					consumed.push_back(pending[ii]);
+					pending.erase(pending.begin() + ii);
+				}
+				else {
+					ii++;
+				}
+			}
+			if (pending.empty()) return true;
+			fds.resize(pending.size());
+			for (size_t ii = 0; ii < pending.size(); ii++) fds[ii] = {pending[ii]->fd(), POLLIN, 0};
+			if (!detail::poll_events(fds, deadline, timeout_usec < 0) && timeout_usec >= 0 && std::chrono::steady_clock::now() >= deadline) {
+				for (auto* event : consumed) {
+					if (!event->is_manual_reset()) event->set();
+				}
+				return false;
+			}
+		}
+	}
+	inline bool wait_all(std::initializer_list<pollable_event*> events, const i64 timeout_usec = -1) {
+		return wait_all(std::vector<pollable_event*>(events), timeout_usec);
+	}
+}
+#endif
+#endif
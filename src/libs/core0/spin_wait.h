@@ -0,0 +1,70 @@
+#ifndef _SPIN_WAIT_H
+#define _SPIN_WAIT_H
+
+#include <thread>
+#include "types.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace core0 {
+	// Tells the CPU we are busy waiting, this saves power and frees the pipeline for a sibling hyper thread.
+	inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		asm volatile("yield");
+#endif
+	}
+
+	// Spin, then yield, then park:
+	// Spinning gives sub microsecond handoff when traffic is flowing, yielding lets other threads run on a loaded CPU
+	// and parking releases the CPU altogether when traffic is idle.
+	struct spin_wait_policy {
+		unsigned spin_iterations = 4000;
+		unsigned yield_iterations = 100;
+		i64 park_timeout_usec = 10000;
+	};
+
+	enum class spin_wait_phase {
+		spin,
+		yield,
+		park,
+		timeout
+	};
+
+	// Counts how many waits were satisfied at each phase (timeout counts parks which ended without success).
+	struct spin_wait_stats {
+		u64 spin = 0;
+		u64 yield = 0;
+		u64 park = 0;
+		u64 timeout = 0;
+		spin_wait_stats& operator+=(const spin_wait_stats& other) {
+			spin += other.spin;
+			yield += other.yield;
+			park += other.park;
+			timeout += other.timeout;
+			return *this;
+		}
+	};
+
+	// Polls try_get() until it succeeds or the policy is exhausted, in which case park(timeout_usec) is called once.
+	// Example use:
+	// auto phase = core0::spin_wait(policy, [&]{ return q.try_dequeue(item); }, [&](i64 usec){ return q.wait_dequeue_timed(item, usec); });
+	template <typename TryGet, typename Park>
+	spin_wait_phase spin_wait(const spin_wait_policy& policy, TryGet&& try_get, Park&& park) {
+		for (unsigned ii = 0; ii < policy.spin_iterations; ii++) {
+			if (try_get()) return spin_wait_phase::spin;
+			cpu_relax();
+		}
+		for (unsigned ii = 0; ii < policy.yield_iterations; ii++) {
+			if (try_get()) return spin_wait_phase::yield;
+			std::this_thread::yield();
+		}
+		return park(policy.park_timeout_usec) ? spin_wait_phase::park : spin_wait_phase::timeout;
+	}
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+#include <utility>
+#include "types.h"
+
+namespace core0 {
+	// Bounded lock free queue for exactly one producer thread and one consumer thread.
+	// The capacity is rounded up to a power of two and never grows, enqueueing to a full queue fails.
+	// Each side owns its index on its own cache line and keeps a cached copy of the other side's index,
+	// so the shared cache lines are only touched when the cached copy runs out (full / empty).
+	// The interface is the subset of moodycamel::BlockingConcurrentQueue which io_ring uses.
+	// Example use:
+	// core0::spsc_queue<int> q(1024);
+	// q.enqueue(1);                // producer thread
+	// q.wait_dequeue_timed(x, 1000); // consumer thread
+	template <typename T>
+	class spsc_queue {
+	public:
+		explicit spsc_queue(const size_t capacity) :
+			m_capacity(std::bit_ceil(capacity ? capacity : 1)), m_mask(m_capacity - 1), m_items(std::make_unique<T[]>(m_capacity)) {
+		}
+		spsc_queue(const spsc_queue&) = delete;
+		spsc_queue& operator=(const spsc_queue&) = delete;
+
+		size_t capacity() const { return m_capacity; }
+
+		// Producer side.
+		bool enqueue(T item) {
+			const size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_cached_head == m_capacity) {
+				m_cached_head = m_head.load(std::memory_order_acquire);
+				if (tail - m_cached_head == m_capacity) return false;
+			}
+			m_items[tail & m_mask] = std::move(item);
+			this->publish(tail + 1);
+			return true;
+		}
+		bool try_enqueue(T item) {
+			return this->enqueue(std::move(item));
+		}
+		template <typename It>
+		bool enqueue_bulk(It first, const size_t count) {
+			const size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (m_capacity - (tail - m_cached_head) < count) {
+				m_cached_head = m_head.load(std::memory_order_acquire);
+				if (m_capacity - (tail - m_cached_head) < count) return false;
+			}
+			for (size_t ii = 0; ii < count; ii++, ++first) m_items[(tail + ii) & m_mask] = std::move(*first);
+			this->publish(tail + count);
+			return true;
+		}
+
+		// Consumer side.
+		bool try_dequeue(T& item) {
+			const size_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_cached_tail) {
+				m_cached_tail = m_tail.load(std::memory_order_acquire);
+				if (head == m_cached_tail) return false;
+			}
+			item = std::move(m_items[head & m_mask]);
+			m_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+		template <typename It>
+		size_t try_dequeue_bulk(It first, const size_t max) {
+			const size_t head = m_head.load(std::memory_order_relaxed);
+			if (m_cached_tail - head < max) m_cached_tail = m_tail.load(std::memory_order_acquire);
+			const size_t count = std::min(max, m_cached_tail - head);
+			for (size_t ii = 0; ii < count; ii++, ++first) *first = std::move(m_items[(head + ii) & m_mask]);
+			if (count) m_head.store(head + count, std::memory_order_release);
+			return count;
+		}
+
+		// Blocks up to timeout_usec for an item, returns false on timeout.
+		bool wait_dequeue_timed(T& item, const i64 timeout_usec) {
+			if (this->try_dequeue(item)) return true;
+			return this->wait_not_empty(timeout_usec) && this->try_dequeue(item);
+		}
+		template <typename It>
+		size_t wait_dequeue_bulk_timed(It first, const size_t max, const i64 timeout_usec) {
+			const size_t count = this->try_dequeue_bulk(first, max);
+			if (count) return count;
+			return this->wait_not_empty(timeout_usec) ? this->try_dequeue_bulk(first, max) : 0;
+		}
+
+		// Exact from either side when the other side is idle, approximate otherwise.
+		size_t size_approx() const {
+			const size_t head = m_head.load(std::memory_order_acquire);
+			const size_t tail = m_tail.load(std::memory_order_acquire);
+			return tail - head;
+		}
+
+	private:
+		// The consumer announces it is going to sleep before it checks the queue one last time and the producer
+		// checks the announcement after it published, so at least one of them sees the other (no lost wake up),
+		// while a producer facing an awake consumer pays a fence and a relaxed load only.
+		void publish(const size_t tail) {
+			m_tail.store(tail, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (m_sleeping.load(std::memory_order_relaxed)) {
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_cv.notify_one();
+			}
+		}
+		bool wait_not_empty(const i64 timeout_usec) {
+			std::unique_lock<std::mutex> lck(m_mtx);
+			m_sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const bool rv = m_cv.wait_for(lck, std::chrono::microseconds(timeout_usec), [this] {
+				return m_tail.load(std::memory_order_acquire) != m_head.load(std::memory_order_relaxed);
+			});
+			m_sleeping.store(false, std::memory_order_relaxed);
+			return rv;
+		}
+
+		const size_t m_capacity;
+		const size_t m_mask;
+		const std::unique_ptr<T[]> m_items;
+		alignas(64) std::atomic<size_t> m_head{0};  // Written by the consumer.
+		size_t m_cached_tail = 0;
+		alignas(64) std::atomic<size_t> m_tail{0};  // Written by the producer.
+		size_t m_cached_head = 0;
+		alignas(64) std::atomic<bool> m_sleeping{false};
+		std::mutex m_mtx;
+		std::condition_variable m_cv;
+	};
+}
+
+#endif
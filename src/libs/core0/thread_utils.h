@@ -0,0 +1,59 @@
+#ifndef _THREAD_UTILS_H
+#define _THREAD_UTILS_H
+
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Placement and naming of the calling thread, these are no-ops which return false on platforms we do not support.
+namespace core0::this_thread {
+	// Pins the calling thread to a set of cpus (an empty set is ignored).
+	inline bool set_affinity(const std::vector<int>& cpus) {
+		if (cpus.empty()) return false;
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (const auto cpu : cpus) {
+			if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+		}
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+
+	// Names the calling thread as seen by top, gdb, perf etc. (Linux truncates names to 15 characters).
+	inline bool set_name(const std::string& name) {
+		if (name.empty()) return false;
+#ifdef __linux__
+		return pthread_setname_np(pthread_self(), name.substr(0, 15).c_str()) == 0;
+#else
+		return false;
+#endif
+	}
+
+	// Switches the calling thread to the SCHED_FIFO real time policy (1 - 99, needs CAP_SYS_NICE or an rtprio limit).
+	inline bool set_fifo_priority(const int priority) {
+#ifdef __linux__
+		sched_param param{};
+		param.sched_priority = priority;
+		return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#else
+		return false;
+#endif
+	}
+
+	// Returns the cpu the calling thread is currently running on or -1.
+	inline int get_cpu() {
+#ifdef __linux__
+		return sched_getcpu();
+#else
+		return -1;
+#endif
+	}
+}
+
+#endif
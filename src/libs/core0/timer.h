@@ -1,14 +1,38 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
 #include <thread>
 #include <chrono>
 #include <atomic>
 #include <mutex>
+#include <memory>
+#include <vector>
 #include <functional>
+#include <algorithm>
 #include "event.h"
+#include "histogram.h"
+#include "spin_wait.h"
+#include "thread_utils.h"
+#include "timer_service.h"
+#include "types.h"
 
 namespace core0 {
+	// Statistics of a precise timer.
+	struct timer_stats {
+		u64 ticks = 0;
+		u64 overruns = 0;                 // Deadlines skipped because the previous callback ran past them.
+		histogram_snapshot jitter_ns;     // How late each callback started relative to its deadline.
+	};
+
+	// A timer on a timer_service (by default the process wide one), so timers no longer cost a thread each.
+	// With the default service the callbacks run on its small thread pool, shared with every other timer of the process:
+	// keep them short, or give the timer a service of its own (core0::timer t(std::make_shared<core0::timer_service>());)
+	// to run its callbacks on a dedicated thread. A period which is due while the previous callback still runs is skipped.
+	// Timers which need a precise fixed rate run on a thread of their own instead (see start_precise()).
 	class timer {
 	public:
-		timer() = default;
+		timer() : timer(timer_service::shared()) {}
+		explicit timer(std::shared_ptr<timer_service> service) : m_service(std::move(service)) {}
 		timer(const timer& t) = delete;
 		timer& operator=(const timer& t) = delete;
 		~timer() { this->stop_sync(); }
@@ -17,22 +41,88 @@ namespace core0 {
 		// core0::timer t;
 		// t.start(1, [](){printf("hi\n"); });
 		bool start(const double& period_sec, std::function<void()> on_timer, const bool auto_restart = true) {
+			std::lock_guard<std::mutex> lck(m_mtx);
+			if (m_running) return false;
+			else if (m_thread.joinable()) m_thread.join();
+			if (m_id) m_service->cancel(m_id);
+			m_expired = false;
+			m_running = true;
+			const auto period_usec = static_cast<size_t>(period_sec * 1e6);
+			m_id = m_service->add(period_usec, [this, on_timer, auto_restart] {
+				if (m_running) on_timer();
+				if (!auto_restart || !m_running) {
+					m_service->cancel_current();
+					m_expired = true;
+				}
+			}, auto_restart ? std::max<size_t>(period_usec, 1) : 0);
+			return true;
+		};
+
+		// Precise mode options.
+		struct precise_options {
+			precise_options() {}
+			int fifo_priority = 0;  // SCHED_FIFO priority of the timer thread, 0 keeps the normal policy.
+			size_t spin_usec = 0;   // Wake up this long before each deadline and spin until it (trades a cpu for wake up jitter).
+			std::vector<int> cpus;  // Pins the timer thread.
+		};
+
+		// Starts a fixed rate timer on a thread of its own: the callbacks are due at start + n * period on the monotonic clock,
+		// whatever the callback runtime and wake up latency were, so the period does not drift.
+		// A callback which runs past the next deadline is an overrun, the missed deadlines are skipped (not called back to back).
+		// Example use:
+		// core0::timer t;
+		// core0::timer::precise_options options;
+		// options.spin_usec = 50;
+		// t.start_precise(0.001, [](){ poll(); }, options);
+		// ...
+		// auto stats = t.get_stats();
+		bool start_precise(const double& period_sec, std::function<void()> on_timer, const precise_options& options = {}) {
+			std::lock_guard<std::mutex> lck(m_mtx);
 			if (m_running) return false;
 			else if (m_thread.joinable()) m_thread.join();
+			if (m_id) m_service->cancel(m_id);
+			m_id.reset();
 			m_expired = false;
 			m_running = true;
-			m_thread = std::thread([&, period_sec, on_timer, auto_restart] {
-				do {
-					if (!m_mtx.try_lock()) break;
-					m_evt.reset();
-					m_mtx.unlock();
-					m_evt.wait( static_cast<size_t>(period_sec * 1e6));
-					if (m_running) on_timer();
-				} while (auto_restart && m_running);
+			m_evt_stop.reset();
+			m_jitter_ns.clear();
+			m_ticks = 0;
+			m_overruns = 0;
+			const auto period = std::max<std::chrono::steady_clock::duration>(
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(period_sec)), std::chrono::microseconds(1));
+			m_thread = std::thread([this, period, on_timer, options] {
+				if (options.fifo_priority > 0) this_thread::set_fifo_priority(options.fifo_priority);
+				this_thread::set_affinity(options.cpus);
+				const auto spin = std::chrono::microseconds(options.spin_usec);
+				auto deadline = std::chrono::steady_clock::now() + period;
+				while (m_running) {
+					if (m_evt_stop.wait_until(deadline - spin)) break;
+					while (std::chrono::steady_clock::now() < deadline) cpu_relax();
+					if (!m_running) break;
+					m_jitter_ns.record(static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - deadline).count()));
+					m_ticks.store(m_ticks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					on_timer();
+					deadline += period;
+					const auto now = std::chrono::steady_clock::now();
+					if (now >= deadline) {
+						const auto missed = (now - deadline) / period + 1;
+						m_overruns.store(m_overruns.load(std::memory_order_relaxed) + missed, std::memory_order_relaxed);
+						deadline += missed * period;
+					}
+				}
 				m_expired = true;
 			});
 			return true;
-		};
+		}
+
+		// Returns the statistics of the precise mode (can be called from any thread while the timer is running).
+		timer_stats get_stats() const {
+			timer_stats stats;
+			stats.ticks = m_ticks.load(std::memory_order_relaxed);
+			stats.overruns = m_overruns.load(std::memory_order_relaxed);
+			stats.jitter_ns = m_jitter_ns.snapshot();
+			return stats;
+		}
 
 		// This will stop the timer synchronously, however do not use it from the timer callback (use stop_async instead).
 		// This is not permitted, and will hang:
@@ -44,11 +134,13 @@ namespace core0 {
 		// ...
 		// t.stop_sync();
 		void stop_sync() {
+			std::lock_guard<std::mutex> lck(m_mtx);
 			m_running = false;
-			m_mtx.lock();
-			m_evt.set();
+			if (m_id) m_service->cancel(m_id);
+			m_id.reset();
+			m_evt_stop.set();
 			if (m_thread.joinable()) m_thread.join();
-			m_mtx.unlock();
+			m_expired = true;
 		}
 
 		// Use this to stop the timer from the callback:
@@ -56,6 +148,7 @@ namespace core0 {
 		// t.start(1, [&](){static int cnt = 0; cnt++; printf("hi\n"); if (cnt == 5) t.stop_async();});
 		void stop_async() {
 			m_running = false;
+			m_evt_stop.set();
 		}
 
 		// Checks if the timer expired (relevant when auto_restart is not set).
@@ -75,10 +168,17 @@ namespace core0 {
 		//   start()
 
 	private:
-		manual_reset_event m_evt;
+		std::shared_ptr<timer_service> m_service;
+		timer_service::timer_id m_id;
 		std::thread m_thread;
-		std::timed_mutex m_mtx;
+		manual_reset_event m_evt_stop;
+		histogram m_jitter_ns;
+		std::atomic<u64> m_ticks{0};
+		std::atomic<u64> m_overruns{0};
+		std::mutex m_mtx;
 		std::atomic<bool> m_running{false};
 		std::atomic<bool> m_expired{true};
 	};
 }
+
+#endif
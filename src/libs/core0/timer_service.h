@@ -0,0 +1,303 @@
+#ifndef _TIMER_SERVICE_H
+#define _TIMER_SERVICE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <array>
+#include <algorithm>
+#include "executor.h"
+#include "types.h"
+
+namespace core0 {
+	// Drives any number of one shot and periodic timers from a single thread using a hierarchical timing wheel.
+	// The wheel has 4 levels of 256 slots, timers far in the future sit in the coarse levels and are cascaded down
+	// as their time approaches, so adding and cancelling a timer is O(1) and a tick only touches the timers which are due.
+	// Callbacks run on the service thread unless a post function is given, in which case they are posted through it
+	// (e.g. core0::executor::poster()). A timer never runs concurrently with itself: a periodic timer which is due while its
+	// previous callback still runs skips that period.
+	// Example use:
+	// core0::timer_service s;
+	// auto id = s.add(1000, [](){printf("once after 1ms\n"); });
+	// auto id = s.add(0, [](){printf("every 10ms\n"); }, 10000);
+	// s.cancel(id);
+	class timer_service {
+	public:
+		using post_function = std::function<void(std::function<void()>)>;
+
+		struct options {
+			options() {}
+			size_t tick_usec = 1000;  // Timer resolution, delays and periods are rounded to whole ticks.
+			post_function post;       // Runs the callbacks, empty to run them on the service thread.
+		};
+
+		// Shared state of a timer, identifies the timer to cancel().
+		struct timer_state {
+			std::function<void()> on_timer;
+			std::atomic<bool> cancelled{false};
+			std::mutex running;  // Held while the callback runs.
+			u32 node = npos;     // Protected by the service mutex.
+		};
+		using timer_id = std::shared_ptr<timer_state>;
+
+		timer_service(const options& options = {}) : m_options(options) {
+			if (!m_options.tick_usec) m_options.tick_usec = 1;
+			m_tick = std::chrono::microseconds(m_options.tick_usec);
+			for (auto& level : m_wheel) level.fill(npos);
+			m_start = std::chrono::steady_clock::now();
+			m_thread = std::thread([this] { this->run(); });
+		}
+		~timer_service() {
+			{
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_run = false;
+			}
+			m_cv.notify_one();
+			if (m_thread.joinable()) m_thread.join();
+		}
+		timer_service(const timer_service&) = delete;
+		timer_service& operator=(const timer_service&) = delete;
+
+		// A process wide service used by core0::timer. Its callbacks run on a small pool (2 to 4 threads),
+		// so a slow callback does not hold up the other timers of the process.
+		static std::shared_ptr<timer_service> shared() {
+			static executor pool([] {
+				executor::options options;
+				options.num_threads = std::clamp(std::thread::hardware_concurrency(), 2u, 4u);
+				options.name = "timer";
+				return options;
+			}());
+			static const auto service = [] {
+				timer_service::options options;
+				options.post = pool.poster();
+				return std::make_shared<timer_service>(options);
+			}();
+			return service;
+		}
+
+		// Calls on_timer once after delay_usec, and then every period_usec if a period is given.
+		timer_id add(const size_t delay_usec, std::function<void()> on_timer, const size_t period_usec = 0) {
+			auto state = std::make_shared<timer_state>();
+			state->on_timer = std::move(on_timer);
+			const auto now = std::chrono::steady_clock::now();
+			std::lock_guard<std::mutex> lck(m_mtx);
+
+			// An idle wheel is not ticking, catch up with the clock first.
+			if (!m_count) m_now_tick = this->tick_of(now);
+			u64 expires = this->tick_of(now + std::chrono::microseconds(delay_usec) + m_tick - std::chrono::nanoseconds(1));
+			if (expires <= m_now_tick) expires = m_now_tick + 1;
+			const u32 index = this->alloc_node();
+			node& n = m_nodes[index];
+			n.expires = expires;
+			n.period = period_usec ? std::max<u64>(1, (period_usec + m_options.tick_usec / 2) / m_options.tick_usec) : 0;
+			n.state = state;
+			state->node = index;
+			this->link(index);
+			if (m_count++ == 0) m_cv.notify_one();
+			return state;
+		}
+
+		// Cancels a timer, returns false if it already expired (one shot) or was cancelled before.
+		// With wait set, returns only once a callback of the timer which already started has finished
+		// (it does not wait when called from the timer's own callback).
+		bool cancel(const timer_id& id, const bool wait = true) {
+			if (!id) return false;
+			const bool removed = this->remove(id.get());
+			if (wait && current_timer() != id.get()) std::lock_guard<std::mutex> lck(id->running);
+			return removed;
+		}
+
+		// Cancels the timer whose callback is running on the calling thread (e.g. a periodic timer which is done).
+		bool cancel_current() {
+			timer_state* state = current_timer();
+			return state ? this->remove(state) : false;
+		}
+
+		// Number of pending timers.
+		size_t size() {
+			std::lock_guard<std::mutex> lck(m_mtx);
+			return m_count;
+		}
+
+	private:
+		static constexpr u32 npos = 0xffffffff;
+		static constexpr unsigned slot_bits = 8;
+		static constexpr unsigned num_slots = 1u << slot_bits;
+		static constexpr unsigned num_levels = 4;
+
+		// Timers are nodes of intrusive doubly linked lists, one list per wheel slot.
+		struct node {
+			u64 expires = 0;  // Tick at which the timer is due.
+			u64 period = 0;   // In ticks, 0 for one shot timers.
+			u32 prev = npos;
+			u32 next = npos;
+			u32 level = 0;
+			u32 slot = 0;
+			timer_id state;
+		};
+
+		static timer_state*& current_timer() {
+			static thread_local timer_state* current = nullptr;
+			return current;
+		}
+
+		bool remove(timer_state* state) {
+			std::lock_guard<std::mutex> lck(m_mtx);
+			state->cancelled = true;
+			if (state->node == npos) return false;
+			this->unlink(state->node);
+			this->free_node(state->node);
+			state->node = npos;
+			m_count--;
+			return true;
+		}
+
+		u64 tick_of(const std::chrono::steady_clock::time_point& time) const {
+			return static_cast<u64>((time - m_start) / m_tick);
+		}
+
+		u32 alloc_node() {
+			if (m_free == npos) {
+				m_nodes.emplace_back();
+				return static_cast<u32>(m_nodes.size() - 1);
+			}
+			const u32 index = m_free;
+			m_free = m_nodes[index].next;
+			return index;
+		}
+		void free_node(const u32 index) {
+			m_nodes[index].state.reset();
+			m_nodes[index].next = m_free;
+			m_free = index;
+		}
+
+		// A timer goes to the finest level whose span covers its remaining delay.
+		void link(const u32 index) {
+			node& n = m_nodes[index];
+			const u64 delta = n.expires > m_now_tick ? n.expires - m_now_tick : 0;
+			u32 level = 0;
+			while (level < num_levels - 1 && delta >= (u64(1) << (slot_bits * (level + 1)))) level++;
+
+			// Beyond the wheel span the timer waits in the last slot in reach and is cascaded again from there.
+			const u64 max_delta = (u64(1) << (slot_bits * num_levels)) - 1;
+			const u64 expires = delta > max_delta ? m_now_tick + max_delta : n.expires;
+			n.level = level;
+			n.slot = static_cast<u32>((expires >> (slot_bits * level)) & (num_slots - 1));
+			u32& head = m_wheel[level][n.slot];
+			n.prev = npos;
+			n.next = head;
+			if (head != npos) m_nodes[head].prev = index;
+			head = index;
+		}
+		void unlink(const u32 index) {
+			node& n = m_nodes[index];
+			if (n.prev != npos) m_nodes[n.prev].next = n.next;
+			else m_wheel[n.level][n.slot] = n.next;
+			if (n.next != npos) m_nodes[n.next].prev = n.prev;
+		}
+
+		// Moves the timers of a coarse slot down to the finer levels.
+		void cascade(const unsigned level, const u32 slot) {
+			u32 index = m_wheel[level][slot];
+			m_wheel[level][slot] = npos;
+			while (index != npos) {
+				const u32 next = m_nodes[index].next;
+				this->link(index);
+				index = next;
+			}
+		}
+
+		// Advances the wheel by one tick and collects the timers which are due.
+		// A periodic timer is rescheduled past target (the tick being caught up to), so it is due once per catch up
+		// after a stall rather than once per missed period.
+		void advance(const u64 target) {
+			m_now_tick++;
+			for (unsigned level = 1; level < num_levels; level++) {
+				if (m_now_tick & ((u64(1) << (slot_bits * level)) - 1)) break;
+				this->cascade(level, static_cast<u32>((m_now_tick >> (slot_bits * level)) & (num_slots - 1)));
+			}
+			const u32 slot = static_cast<u32>(m_now_tick & (num_slots - 1));
+			u32 index = m_wheel[0][slot];
+			m_wheel[0][slot] = npos;
+			while (index != npos) {
+				node& n = m_nodes[index];
+				const u32 next = n.next;
+				if (n.expires > m_now_tick) {
+					this->link(index);
+				}
+				else {
+					m_due.push_back(n.state);
+					if (n.period) {
+						n.expires += n.period;
+						if (n.expires <= target) n.expires += ((target - n.expires) / n.period + 1) * n.period;
+						this->link(index);
+					}
+					else {
+						n.state->node = npos;
+						this->free_node(index);
+						m_count--;
+					}
+				}
+				index = next;
+			}
+		}
+
+		void dispatch(const timer_id& state) {
+			auto task = [state] {
+				std::unique_lock<std::mutex> lck(state->running, std::try_to_lock);
+				if (!lck || state->cancelled) return;
+				current_timer() = state.get();
+				state->on_timer();
+				current_timer() = nullptr;
+			};
+			if (m_options.post) m_options.post(std::move(task));
+			else task();
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> lck(m_mtx);
+			while (m_run) {
+				if (!m_count) {
+					m_cv.wait(lck, [this] { return !m_run || m_count; });
+					continue;
+				}
+
+				// Ticks are counted from the service start, so they do not drift with the wake up latency.
+				const auto next_tick = m_start + (m_now_tick + 1) * m_tick;
+				if (m_cv.wait_until(lck, next_tick, [this] { return !m_run; })) break;
+				const u64 target = this->tick_of(std::chrono::steady_clock::now());
+				while (m_now_tick < target && m_count) this->advance(target);
+				if (!m_count) m_now_tick = target;
+				if (m_due.empty()) continue;
+				std::vector<timer_id> due;
+				due.swap(m_due);
+				lck.unlock();
+				for (const auto& state : due) this->dispatch(state);
+				due.clear();
+				lck.lock();
+				if (m_due.empty()) m_due.swap(due);
+			}
+		}
+
+		options m_options;
+		std::chrono::steady_clock::duration m_tick;
+		std::chrono::steady_clock::time_point m_start;
+		std::mutex m_mtx;
+		std::condition_variable m_cv;
+		bool m_run = true;
+		u64 m_now_tick = 0;
+		size_t m_count = 0;
+		std::array<std::array<u32, num_slots>, num_levels> m_wheel;
+		std::vector<node> m_nodes;
+		u32 m_free = npos;
+		std::vector<timer_id> m_due;
+		std::thread m_thread;
+	};
+}
+
+#endif
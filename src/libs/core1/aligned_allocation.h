@@ -5,6 +5,7 @@
 #include <string.h>
 #include <memory>
 #include "posix_memalign_xp.h"
+#include "arena.h"
 
 namespace core1 {
 	namespace memory {
@@ -15,6 +16,12 @@ namespace core1 {
 			}
 		};
 
+		// Arena memory is released with its arena.
+		template <class T>
+		struct delete_arena {
+			void operator()(T *) const {}
+		};
+
 		template <class T>
 		std::unique_ptr<T[], delete_aligned<T>> allocate_aligned(const size_t length, const size_t alignment) {
 			T *raw = 0;
@@ -22,6 +29,14 @@ namespace core1 {
 			int error = posix_memalign((void **)&raw, alignment, sizeof(T) * length);
 			return std::unique_ptr<T[], delete_aligned<T>>{raw};
 		}
+
+		// Same, from an arena (huge pages, NUMA binding, prefaulted). Returns nullptr if the arena is exhausted.
+		template <class T>
+		std::unique_ptr<T[], delete_arena<T>> allocate_aligned(const size_t length, const size_t alignment, arena& arena) {
+			if (alignment < 1) return nullptr;
+			T *raw = static_cast<T*>(arena.allocate(sizeof(T) * length, alignment));
+			return std::unique_ptr<T[], delete_arena<T>>{raw};
+		}
 	}
 }
 #endif
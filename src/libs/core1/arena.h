@@ -0,0 +1,174 @@
+#ifndef _MEMORY_ARENA_H
+#define _MEMORY_ARENA_H
+
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#include "aligned_transfer.h"
+#include "numa_utils.h"
+#include "posix_memalign_xp.h"
+
+namespace core1::memory {
+	// What actually backs an arena, in fallback order.
+	enum class arena_pages {
+		huge_1g,      // MAP_HUGETLB 1 GiB pages (reserved with hugepagesz=1G hugepages=N on the kernel command line).
+		huge_2m,      // MAP_HUGETLB 2 MiB pages (reserved in /proc/sys/vm/nr_hugepages).
+		transparent,  // Normal pages with madvise(MADV_HUGEPAGE), the kernel collapses them into 2 MiB pages when it can.
+		normal
+	};
+
+	// One large mapping for long lived buffers (capture buffers, io_ring slots etc.), backed by huge pages, bound to a NUMA node
+	// and faulted in up front, so neither page faults nor TLB misses hit the hot path.
+	// Allocation is a lock free pointer bump, memory is given back all at once by reset() or by destroying the arena.
+	// Example use:
+	// core1::memory::arena::options options;
+	// options.numa_node = 0;
+	// core1::memory::arena arena(512 << 20, options);   // arena.pages() tells what it got
+	// auto samples = core1::memory::allocate_aligned<i16>(1 << 20, 4096, arena);
+	// core1::memory::arena_transfer transfer(arena, 1 << 20, 4096);
+	class arena {
+	public:
+		struct options {
+			options() {}
+			arena_pages pages = arena_pages::huge_2m;  // Preferred pages.
+			bool fallback = true;                      // Try the next kind of pages when the preferred ones are not available.
+			int numa_node = -1;                        // Binds the memory to a NUMA node, -1 for the default policy.
+			bool prefault = true;                      // Touches every page in the constructor.
+		};
+
+		explicit arena(const size_t size, const options& options = {}) {
+			for (int pages = static_cast<int>(options.pages); pages <= static_cast<int>(arena_pages::normal); pages++) {
+				if (this->map(size, static_cast<arena_pages>(pages))) break;
+				if (!options.fallback) return;
+			}
+			if (!m_base) return;
+			if (options.numa_node >= 0) m_numa_bound = bind_to_numa_node(m_base, m_size, options.numa_node, false);
+			if (options.prefault) this->prefault();
+		}
+		~arena() {
+			if (!m_base) return;
+#ifdef __linux__
+			munmap(m_base, m_size);
+#else
+			free(m_base);
+#endif
+		}
+		arena(const arena&) = delete;
+		arena& operator=(const arena&) = delete;
+
+		operator bool() const { return m_base != nullptr; }
+
+		// Returns nullptr when the arena is exhausted. Can be called from any thread.
+		void* allocate(const size_t size, const size_t alignment = 64) {
+			const size_t align = alignment ? alignment : 1;
+			size_t used = m_used.load(std::memory_order_relaxed);
+			size_t offset;
+			do {
+				offset = (reinterpret_cast<size_t>(m_base) + used + align - 1) / align * align - reinterpret_cast<size_t>(m_base);
+				if (!m_base || offset + size > m_size) return nullptr;
+			} while (!m_used.compare_exchange_weak(used, offset + size, std::memory_order_relaxed));
+			return m_base + offset;
+		}
+
+		// Gives back every allocation at once, the pages stay mapped (and faulted in).
+		void reset() { m_used = 0; }
+
+		arena_pages pages() const { return m_pages; }
+		size_t page_size() const { return m_page_size; }
+		size_t capacity() const { return m_size; }
+		size_t used() const { return m_used.load(std::memory_order_relaxed); }
+		bool numa_bound() const { return m_numa_bound; }
+
+	private:
+		static size_t round_up(const size_t size, const size_t page) { return (size + page - 1) / page * page; }
+
+		bool map(const size_t size, const arena_pages pages) {
+#ifdef __linux__
+			constexpr size_t huge_2m = size_t(2) << 20;
+			constexpr size_t huge_1g = size_t(1) << 30;
+			constexpr int huge_shift = 26;  // MAP_HUGE_SHIFT
+			void* addr = MAP_FAILED;
+			size_t len = 0;
+			switch (pages) {
+				case arena_pages::huge_1g:
+					len = round_up(size, huge_1g);
+					addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (30 << huge_shift), -1, 0);
+					m_page_size = huge_1g;
+					break;
+				case arena_pages::huge_2m:
+					len = round_up(size, huge_2m);
+					addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << huge_shift), -1, 0);
+					m_page_size = huge_2m;
+					break;
+				case arena_pages::transparent: {
+					// Map an extra huge page and trim the ends, so the range starts on a 2 MiB boundary the kernel can collapse.
+					len = round_up(size, huge_2m);
+					auto* raw = static_cast<unsigned char*>(mmap(nullptr, len + huge_2m, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+					if (raw == MAP_FAILED) break;
+					auto* aligned = reinterpret_cast<unsigned char*>(round_up(reinterpret_cast<size_t>(raw), huge_2m));
+					if (aligned != raw) munmap(raw, aligned - raw);
+					if (raw + len + huge_2m != aligned + len) munmap(aligned + len, raw + huge_2m - aligned);
+					if (madvise(aligned, len, MADV_HUGEPAGE) != 0) {
+						munmap(aligned, len);
+						break;
+					}
+					addr = aligned;
+					m_page_size = huge_2m;
+					break;
+				}
+				case arena_pages::normal:
+					len = round_up(size, memory::page_size());
+					addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+					m_page_size = memory::page_size();
+					break;
+			}
+			if (addr == MAP_FAILED) return false;
+			m_base = static_cast<unsigned char*>(addr);
+			m_size = len;
+			m_pages = pages;
+			return true;
+#else
+			if (pages != arena_pages::normal) return false;
+			m_size = round_up(size, memory::page_size());
+			if (posix_memalign((void **)&m_base, memory::page_size(), m_size)) m_base = nullptr;
+			m_page_size = memory::page_size();
+			m_pages = pages;
+			return m_base != nullptr;
+#endif
+		}
+
+		// Huge pages are reserved up front and only need one touch each, transparent huge pages may still be backed by normal pages.
+		void prefault() {
+			const size_t stride = m_pages == arena_pages::transparent ? memory::page_size() : m_page_size;
+			for (size_t offset = 0; offset < m_size; offset += stride) {
+				reinterpret_cast<volatile unsigned char*>(m_base)[offset] = 0;
+			}
+		}
+
+		unsigned char* m_base = nullptr;
+		size_t m_size = 0;
+		size_t m_page_size = 0;
+		arena_pages m_pages = arena_pages::normal;
+		bool m_numa_bound = false;
+		std::atomic<size_t> m_used{0};
+	};
+
+	// An aligned_transfer whose buffer lives in an arena (it is not freed with the transfer, only with the arena).
+	// capacity is 0 if the arena is exhausted. The buffer is not zeroed.
+	struct arena_transfer : aligned_transfer<false> {
+		arena_transfer() noexcept {}
+		arena_transfer(arena& arena, const size_t capacity, const size_t alignment = 0) noexcept {
+			this->alignment = alignment;
+			// Same layout as aligned_transfer: alignment extra bytes behind the capacity.
+			buffer = static_cast<unsigned char*>(arena.allocate(capacity + alignment, alignment ? alignment : 64));
+			if (buffer) this->capacity = capacity;
+		}
+		arena_transfer(arena_transfer&& other) noexcept = default;
+		arena_transfer& operator=(arena_transfer&& other) noexcept = default;
+		~arena_transfer() override { buffer = nullptr; }
+	};
+}
+#endif
@@ -0,0 +1,219 @@
+#ifndef _IO_PIPELINE_HPP__
+#define _IO_PIPELINE_HPP__
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <string>
+#include "concurrentqueue/blockingconcurrentqueue.h"
+#include "core0/event.h"
+#include "core0/spin_wait.h"
+#include "core0/types.h"
+#include "io_ring.hpp"
+
+namespace core1::buffer_utils {
+	// Snapshot of a pipeline stage, a stage whose queue keeps growing while all its threads are busy is the bottleneck.
+	struct io_pipeline_occupancy {
+		size_t queued = 0;       // Items waiting in the stage input queue.
+		size_t in_progress = 0;  // Threads of the stage which are currently inside the stage callback.
+		u64 processed = 0;       // Items processed by the stage since the last reset.
+		core0::spin_wait_stats wait;
+	};
+
+	// A recycling ring generalized to N stages: items flow from stage to stage and from the last stage back to the first one.
+	// Example use (acquire -> decode -> publish):
+	// core1::buffer_utils::io_pipeline<frame> p(64, {
+	// 	{[](frame& f){ acquire(f); }},
+	// 	{[](frame& f){ decode(f); }, 4, core1::buffer_utils::io_ring_mode::adaptive},
+	// 	{[](frame& f){ publish(f); }}
+	// });
+	// p.start();
+	template <typename T, io_ring_storage S = io_ring_storage::bounded>
+	class io_pipeline {
+	public:
+		static constexpr bool is_bounded = S == io_ring_storage::bounded;
+		using handle = u32;
+		using item_type = std::conditional_t<is_bounded, T, std::shared_ptr<T>>;
+		using cb_on_item = std::function<void(item_type&)>;
+
+		// Stage threads are pinned and named as in io_ring_thread_options (<name><ii>).
+		struct stage {
+			cb_on_item on_item;
+			unsigned char num_thr = 1;
+			io_ring_mode mode = io_ring_mode::blocking;
+			core0::spin_wait_policy wait_policy;
+			std::vector<std::vector<int>> cpus;
+			std::string name;
+		};
+
+		io_pipeline(const size_t& ring_size, std::vector<stage> stages) : m_stages(std::move(stages)) {
+			m_queue_size = ring_size;
+			if (m_queue_size == 0) m_queue_size = 1;
+			if (m_stages.empty()) m_stages.push_back(stage{[](item_type&) {}});
+			size_t num_producers = 1;
+			for (auto& s : m_stages) {
+				if (s.num_thr == 0) s.num_thr = 1;
+				num_producers += s.num_thr;
+			}
+			m_queues.resize(m_stages.size());
+			for (auto& queue : m_queues) {
+				if constexpr (is_bounded) queue = std::make_unique<queue_type>(m_queue_size, 0, num_producers);
+				else queue = std::make_unique<queue_type>();
+			}
+			m_counters = std::make_unique<stage_counters[]>(num_producers - 1);
+			m_workers.resize(num_producers - 1);
+			if constexpr (is_bounded) {
+				// Place the slots on the NUMA node of the first stage, which is where items are (re)filled.
+				m_slots = detail::slot_array<T>(m_queue_size);
+				const auto& first_cpus = m_stages[0].cpus;
+				if (!first_cpus.empty() && !first_cpus[0].empty()) m_slots.bind_to_cpu_node(first_cpus[0][0]);
+				this->prime();
+			}
+		}
+		~io_pipeline() { this->stop(); }
+
+		// The pipeline is initially empty, It should be filled by sumitting items (up to its size).
+		bool submit(std::shared_ptr<T> item) requires (!is_bounded) {
+			return m_queues[0]->enqueue(item);
+		}
+
+		// A bounded pipeline is created full, all its slots are already submitted to the first stage.
+		T& slot(const handle h) requires (is_bounded) {
+			return m_slots[h];
+		}
+		handle handle_of(const T& item) const requires (is_bounded) {
+			return static_cast<handle>(&item - m_slots.get());
+		}
+		size_t capacity() const {
+			return m_queue_size;
+		}
+		size_t num_stages() const {
+			return m_stages.size();
+		}
+
+		// Resets the pipeline to initial condition.
+		bool reset() {
+			this->stop();
+			queue_item item{};
+			for (auto& queue : m_queues) {
+				while (queue->try_dequeue(item)) {};
+			}
+			if constexpr (is_bounded) this->prime();
+			for (size_t thr_index = 0; thr_index < m_workers.size(); thr_index++) m_counters[thr_index].clear();
+			return true;
+		}
+
+		// Starts the pipeline.
+		bool start() {
+			if (m_run) return false;
+			else m_run = true;
+			core0::auto_reset_event evt_started[m_workers.size()];
+			size_t thr_index = 0;
+			for (size_t stage_index = 0; stage_index < m_stages.size(); stage_index++) {
+				for (auto ii = 0; ii < m_stages[stage_index].num_thr; ii++, thr_index++) {
+					m_workers[thr_index] = std::thread([&, stage_index, thr_index, ii] {
+						const auto& s = m_stages[stage_index];
+						detail::configure_this_thread(s.cpus, ii, s.name.empty() ? "" : s.name + std::to_string(ii));
+						evt_started[thr_index].set();
+						this->run_stage(stage_index, m_counters[thr_index]);
+					});
+				}
+			}
+
+			// Wait until all threads actually start before returning.
+			for (thr_index = 0; thr_index < m_workers.size(); thr_index++) evt_started[thr_index].wait();
+			return true;
+		}
+
+		// Stops the pipeline.
+		void stop() {
+			m_run = false;
+			for (auto& worker : m_workers) {
+				if (worker.joinable()) worker.join();
+			}
+		}
+
+		// Returns an approximate number of items in the pipeline.
+		size_t size_approx() {
+			size_t size = 0;
+			for (auto& queue : m_queues) size += queue->size_approx();
+			return size;
+		}
+
+		// Returns the occupancy of a stage (can be called from any thread while the pipeline is running).
+		io_pipeline_occupancy get_occupancy(const size_t stage_index) const {
+			io_pipeline_occupancy occupancy;
+			if (stage_index >= m_stages.size()) return occupancy;
+			occupancy.queued = m_queues[stage_index]->size_approx();
+			const size_t first_thr = this->first_thread(stage_index);
+			for (size_t thr_index = first_thr; thr_index < first_thr + m_stages[stage_index].num_thr; thr_index++) {
+				const auto& counters = m_counters[thr_index];
+				occupancy.in_progress += counters.busy.load(std::memory_order_relaxed);
+				occupancy.processed += counters.items.load(std::memory_order_relaxed);
+				occupancy.wait += counters.waits.snapshot();
+			}
+			return occupancy;
+		}
+
+	private:
+		using queue_item = std::conditional_t<is_bounded, handle, std::shared_ptr<T>>;
+		using queue_type = moodycamel::BlockingConcurrentQueue<queue_item>;
+
+		struct stage_counters : detail::worker_counters {
+			std::atomic<u32> busy{0};
+		};
+
+		void prime() requires (is_bounded) {
+			for (handle h = 0; h < m_queue_size; h++) m_queues[0]->enqueue(h);
+		}
+
+		item_type& resolve(queue_item& item) {
+			if constexpr (is_bounded) return m_slots[item];
+			else return item;
+		}
+
+		size_t first_thread(const size_t stage_index) const {
+			size_t thr_index = 0;
+			for (size_t ii = 0; ii < stage_index; ii++) thr_index += m_stages[ii].num_thr;
+			return thr_index;
+		}
+
+		// Stage i dequeues from queue i and enqueues to queue i + 1, the last stage enqueues back to the first queue.
+		void run_stage(const size_t stage_index, stage_counters& counters) {
+			const stage& s = m_stages[stage_index];
+			queue_type& src = *m_queues[stage_index];
+			queue_type& dst = *m_queues[(stage_index + 1) % m_queues.size()];
+			queue_item item{};
+			while (m_run) {
+				const bool dequeued = detail::wait_for_items(
+					s.mode,
+					s.wait_policy,
+					[&] { return src.try_dequeue(item); },
+					[&](const i64 timeout_usec) { return src.wait_dequeue_timed(item, timeout_usec); },
+					counters.waits);
+				if (!dequeued) continue;
+				if (!m_run) {
+					src.enqueue(std::move(item));
+					break;
+				}
+				counters.busy.store(1, std::memory_order_relaxed);
+				s.on_item(this->resolve(item));
+				counters.busy.store(0, std::memory_order_relaxed);
+				stage_counters::add(counters.items, 1);
+				dst.enqueue(std::move(item));
+			}
+		}
+
+		std::atomic_bool m_run{false};
+		size_t m_queue_size;
+		std::vector<stage> m_stages;
+		std::vector<std::unique_ptr<queue_type>> m_queues;
+		std::vector<std::thread> m_workers;
+		std::unique_ptr<stage_counters[]> m_counters;
+		detail::slot_array<T> m_slots;
+	};
+}
+#endif
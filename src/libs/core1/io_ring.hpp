@@ -6,120 +6,464 @@
 #include <thread>
 #include <vector>
 #include <functional>
+#include <type_traits>
+#include <span>
+#include <iterator>
+#include <string>
+#include <new>
+#include <chrono>
+#include <algorithm>
+#include <bit>
+#include <utility>
 #include "concurrentqueue/blockingconcurrentqueue.h"
 #include "core0/event.h"
+#include "core0/executor.h"
+#include "core0/histogram.h"
+#include "core0/spin_wait.h"
+#include "core0/spsc_queue.h"
+#include "core0/thread_utils.h"
+#include "core0/types.h"
+#ifdef __linux__
+#include <coroutine>
+#include "core0/coroutine.h"
+#endif
+#include "posix_memalign_xp.h"
+#include "numa_utils.h"
 
 namespace core1::buffer_utils {
+	// blocking     - workers wait on the queue with a timeout (park timeout of the wait policy).
+	// non_blocking - workers poll the queue in a tight loop.
+	// adaptive     - workers spin, then yield, then park according to the wait policy.
 	enum class io_ring_mode {
 		blocking,
-		non_blocking
+		non_blocking,
+		adaptive
+	};
+
+	// shared  - the user submits std::shared_ptr<T> items, which travel through the queues as is.
+	// bounded - the ring owns ring_size preallocated items and moves them between the stages as u32 handles,
+	//           so steady state operation does not allocate and does not touch any reference count.
+	enum class io_ring_storage {
+		shared,
+		bounded
+	};
+
+	// mpmc - moodycamel::BlockingConcurrentQueue, any number of submit and complete threads.
+	// spsc - core0::spsc_queue, a bounded lock free ring for one submit thread and one complete thread (the thread counts are forced to 1).
+	//        Shared storage rings can only be submitted to while stopped, since the completer is the only producer of the submission queue.
+	enum class io_ring_queue {
+		mpmc,
+		spsc
+	};
+
+	// How often each wait phase was hit by the worker threads of each stage.
+	struct io_ring_wait_stats {
+		core0::spin_wait_stats submit;
+		core0::spin_wait_stats complete;
+	};
+
+	// Statistics of a ring stage, items and wait phases are always counted, the rest only when statistics are enabled.
+	struct io_ring_stage_stats {
+		u64 items = 0;
+		u64 callback_ns = 0;          // Total time spent in the stage callback.
+		size_t queue_high_water = 0;  // Highest depth seen on the stage input queue.
+		core0::spin_wait_stats wait;
+	};
+
+	struct io_ring_stats {
+		io_ring_stage_stats submit;
+		io_ring_stage_stats complete;
+		core0::histogram_snapshot latency_ns;  // From the submitter taking an item until the completer is done with it (bounded rings).
+	};
+
+	// CPU placement and naming of the worker threads.
+	// Thread ii of a stage is pinned to cpus[ii % cpus.size()], an empty list leaves the stage to the scheduler.
+	// Threads are named <name>.s<ii> and <name>.c<ii> (Linux truncates names to 15 characters).
+	// With numa_local_storage the slots of a bounded ring are moved to the NUMA node of the first submitter cpu,
+	// buffers owned by the slots follow the first touch policy, so initialize them from a thread running on that node.
+	struct io_ring_thread_options {
+		std::string name;
+		std::vector<std::vector<int>> submit_cpus;
+		std::vector<std::vector<int>> complete_cpus;
+		bool numa_local_storage = true;
 	};
-	template <typename T, io_ring_mode I = io_ring_mode::blocking>
+
+	namespace detail {
+		// Page aligned array of default constructed items, so it can be moved between NUMA nodes without touching its neighbours.
+		// Throws std::bad_alloc if the slots cannot be allocated (as the queues of the ring would).
+		template <typename T>
+		class slot_array {
+		public:
+			slot_array() = default;
+			explicit slot_array(const size_t count) {
+				const size_t page = memory::page_size();
+				m_bytes = (count * sizeof(T) + page - 1) / page * page;
+				if (posix_memalign(reinterpret_cast<void**>(&m_items), page, m_bytes)) {
+					m_items = nullptr;
+					throw std::bad_alloc();
+				}
+				m_count = count;
+				for (size_t ii = 0; ii < m_count; ii++) new (&m_items[ii]) T();
+			}
+			slot_array(const slot_array&) = delete;
+			slot_array& operator=(const slot_array&) = delete;
+			slot_array(slot_array&& other) noexcept { *this = std::move(other); }
+			slot_array& operator=(slot_array&& other) noexcept {
+				std::swap(m_items, other.m_items);
+				std::swap(m_count, other.m_count);
+				std::swap(m_bytes, other.m_bytes);
+				return *this;
+			}
+			~slot_array() {
+				if (!m_items) return;
+				for (size_t ii = 0; ii < m_count; ii++) m_items[ii].~T();
+				free(m_items);
+			}
+
+			T& operator[](const size_t index) const { return m_items[index]; }
+			T* get() const { return m_items; }
+			bool bind_to_cpu_node(const int cpu) const {
+				return memory::bind_to_numa_node(m_items, m_bytes, memory::numa_node_of_cpu(cpu));
+			}
+
+		private:
+			T* m_items = nullptr;
+			size_t m_count = 0;
+			size_t m_bytes = 0;
+		};
+
+		// Applies the placement and name of a worker thread from within the thread.
+		inline void configure_this_thread(const std::vector<std::vector<int>>& cpus, const size_t thr_index, const std::string& name) {
+			if (!cpus.empty()) core0::this_thread::set_affinity(cpus[thr_index % cpus.size()]);
+			if (!name.empty()) core0::this_thread::set_name(name);
+		}
+
+		// Each worker thread owns its counters, so counting is a relaxed load and store on a private cache line.
+		struct alignas(64) wait_counters {
+			std::atomic<u64> spin{0}, yield{0}, park{0}, timeout{0};
+			static void count(std::atomic<u64>& counter) { counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+			void count(const core0::spin_wait_phase phase) {
+				switch (phase) {
+					case core0::spin_wait_phase::spin: count(spin); break;
+					case core0::spin_wait_phase::yield: count(yield); break;
+					case core0::spin_wait_phase::park: count(park); break;
+					case core0::spin_wait_phase::timeout: count(timeout); break;
+				}
+			}
+			core0::spin_wait_stats snapshot() const {
+				return {spin.load(std::memory_order_relaxed), yield.load(std::memory_order_relaxed), park.load(std::memory_order_relaxed), timeout.load(std::memory_order_relaxed)};
+			}
+			void clear() {
+				spin = 0;
+				yield = 0;
+				park = 0;
+				timeout = 0;
+			}
+		};
+
+		// Per worker statistics, owned and written by a single worker thread.
+		struct worker_counters {
+			wait_counters waits;
+			std::atomic<u64> items{0};
+			std::atomic<u64> callback_ns{0};
+			std::atomic<u64> dst_high_water{0};
+			core0::histogram latency_ns;
+			static void add(std::atomic<u64>& counter, const u64 value) {
+				counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+			}
+			void track_high_water(const u64 depth) {
+				if (depth > dst_high_water.load(std::memory_order_relaxed)) dst_high_water.store(depth, std::memory_order_relaxed);
+			}
+			void clear() {
+				waits.clear();
+				items = 0;
+				callback_ns = 0;
+				dst_high_water = 0;
+				latency_ns.clear();
+			}
+		};
+
+		inline i64 now_ns() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		// Waits for items according to the mode, try_get() polls the queue and wait_get(timeout_usec) blocks on it.
+		template <typename TryGet, typename WaitGet>
+		bool wait_for_items(const io_ring_mode mode, const core0::spin_wait_policy& policy, TryGet&& try_get, WaitGet&& wait_get, wait_counters& counters) {
+			if (mode == io_ring_mode::blocking) {
+				const bool rv = wait_get(policy.park_timeout_usec);
+				counters.count(rv ? core0::spin_wait_phase::park : core0::spin_wait_phase::timeout);
+				return rv;
+			}
+			else if (mode == io_ring_mode::non_blocking) {
+				if (!try_get()) return false;
+				counters.count(core0::spin_wait_phase::spin);
+				return true;
+			}
+			else {
+				const auto phase = core0::spin_wait(policy, try_get, wait_get);
+				counters.count(phase);
+				return phase != core0::spin_wait_phase::timeout;
+			}
+		}
+	}
+
+	template <typename T, io_ring_mode I = io_ring_mode::blocking, io_ring_storage S = io_ring_storage::shared, io_ring_queue Q = io_ring_queue::mpmc>
 	class io_ring {
 	public:
+		static constexpr bool is_bounded = S == io_ring_storage::bounded;
+		static constexpr bool is_spsc = Q == io_ring_queue::spsc;
+		using handle = u32;
+		using item_type = std::conditional_t<is_bounded, T, std::shared_ptr<T>>;
+
+		// Batches are passed as they came out of the queue, bounded rings pass handles which are resolved with slot().
+		using batch_item = std::conditional_t<is_bounded, handle, std::shared_ptr<T>>;
+
 		io_ring(const size_t& ring_size, const unsigned char num_submit_thr = 1, const unsigned char num_complete_thr = 1) {
 			m_queue_size = ring_size;
 			if (m_queue_size == 0) m_queue_size = 1;
-			m_submission_queue = std::make_unique<moodycamel::BlockingConcurrentQueue<std::shared_ptr<T>>>();
-			m_completion_queue = std::make_unique<moodycamel::BlockingConcurrentQueue<std::shared_ptr<T>>>();
-			m_num_submit_thr = num_submit_thr;
-			m_num_complete_thr = num_complete_thr;
+			m_num_submit_thr = is_spsc ? 1 : num_submit_thr;
+			m_num_complete_thr = is_spsc ? 1 : num_complete_thr;
 			m_submitter.resize(m_num_submit_thr);
 			m_completer.resize(m_num_complete_thr);
+			m_counters = std::make_unique<worker_counters[]>(m_num_submit_thr + m_num_complete_thr);
+			if constexpr (is_spsc) {
+				m_submission_queue = std::make_unique<queue_type>(m_queue_size);
+				m_completion_queue = std::make_unique<queue_type>(m_queue_size);
+			}
+			else if constexpr (is_bounded) {
+				// The number of items in flight is known, so the queues can preallocate all their blocks up front.
+				// Every worker thread and the user thread may act as an implicit producer.
+				const size_t num_producers = m_num_submit_thr + m_num_complete_thr + 1;
+				m_submission_queue = std::make_unique<queue_type>(m_queue_size, 0, num_producers);
+				m_completion_queue = std::make_unique<queue_type>(m_queue_size, 0, num_producers);
+			}
+			else {
+				m_submission_queue = std::make_unique<queue_type>();
+				m_completion_queue = std::make_unique<queue_type>();
+			}
+			if constexpr (is_bounded) {
+				m_slots = detail::slot_array<T>(m_queue_size);
+				m_stamps = std::make_unique<i64[]>(m_queue_size);
+				this->prime();
+			}
 		}
-		~io_ring() {};
+		~io_ring() { this->stop(); };
 
-		using cb_on_submit = std::function<void(std::shared_ptr<T>&)>;
-		using cb_on_complete = std::function<void(std::shared_ptr<T>&)>;
+		using cb_on_submit = std::function<void(item_type&)>;
+		using cb_on_complete = std::function<void(item_type&)>;
+		using cb_on_submit_batch = std::function<void(std::span<batch_item>)>;
+		using cb_on_complete_batch = std::function<void(std::span<batch_item>)>;
 
 		// The ring is initially empty, It should be filled by sumitting items (up to its size).
-		bool submit(std::shared_ptr<T> item) {
+		bool submit(std::shared_ptr<T> item) requires (!is_bounded) {
+			if (is_spsc && m_run) return false;
 			return m_submission_queue->enqueue(item);
 		}
 
+		// A bounded ring is created full, all its slots are already submitted.
+		// Slots should be initialized (e.g. buffers allocated) before the ring is started.
+		T& slot(const handle h) requires (is_bounded) {
+			return m_slots[h];
+		}
+		handle handle_of(const T& item) const requires (is_bounded) {
+			return static_cast<handle>(&item - m_slots.get());
+		}
+		size_t capacity() const {
+			return m_queue_size;
+		}
+
+		// Sets the wait policy of the worker threads (only while the ring is stopped).
+		// The blocking mode uses only the park timeout, the non blocking mode ignores the policy.
+		bool set_wait_policy(const core0::spin_wait_policy& policy) {
+			if (m_run) return false;
+			m_wait_policy = policy;
+			return true;
+		}
+
+		// Sets the placement and names of the worker threads (only while the ring is stopped).
+		bool set_thread_options(const io_ring_thread_options& options) {
+			if (m_run) return false;
+			m_thread_options = options;
+			if constexpr (is_bounded) {
+				if (options.numa_local_storage && !options.submit_cpus.empty() && !options.submit_cpus[0].empty()) {
+					m_slots.bind_to_cpu_node(options.submit_cpus[0][0]);
+				}
+			}
+			return true;
+		}
+
+		// Enables the ordered completion mode of a bounded ring (only while the ring is stopped, a zero window disables it).
+		// Submitters number the items in the order they take them from the submission queue (see sequence_of()),
+		// and completers release them to on_complete strictly in that order,
+		// so several threads can run an expensive submit callback while delivery stays ordered.
+		// At most window items (rounded up to a power of two) may be in flight past the oldest unreleased item,
+		// a submitter which gets too far ahead waits, so a slow item applies backpressure instead of buffering without limit.
+		// The ordered mode applies to start(), start_batch() refuses to start while it is enabled.
+		bool set_ordered(const size_t window) requires (is_bounded) {
+			if (m_run) return false;
+			m_window_size = 0;
+			m_window.reset();
+			if (!window) return true;
+			m_window_size = std::bit_ceil(window);
+			m_window = std::make_unique<window_slot[]>(m_window_size);
+			if (!m_seq) m_seq = std::make_unique<u64[]>(m_queue_size);
+			m_next_seq = 0;
+			m_released = 0;
+			return true;
+		}
+
+		// Returns the sequence number given to an item by the ordered mode (valid from the submit callback onwards).
+		u64 sequence_of(const T& item) const requires (is_bounded) {
+			return m_seq ? m_seq[this->handle_of(item)] : 0;
+		}
+
+		// Enables timing, queue depth and latency statistics (only while the ring is stopped).
+		// When disabled the workers only count items and wait phases.
+		bool enable_stats(const bool enable) {
+			if (m_run) return false;
+			if constexpr (is_bounded) {
+				// Items already in the ring were not stamped by a submitter, they are left out of the latency.
+				if (enable && !m_stats_enabled) std::fill_n(m_stamps.get(), m_queue_size, i64(0));
+			}
+			m_stats_enabled = enable;
+			return true;
+		}
+
 		// Resets the ring to initial condition.
 		bool reset() {
 			this->stop();
-			std::shared_ptr<T> item = nullptr;
+			queue_item item{};
 			while (m_submission_queue->try_dequeue(item)) {};
 			while (m_completion_queue->try_dequeue(item)) {};
+			if constexpr (is_bounded) {
+				this->prime();
+				for (size_t ii = 0; ii < m_window_size; ii++) m_window[ii].tag = 0;
+				m_next_seq = 0;
+				m_released = 0;
+			}
+			for (auto thr_index = 0; thr_index < m_num_submit_thr + m_num_complete_thr; thr_index++) m_counters[thr_index].clear();
+			return true;
+		}
+
+		// Runs the stage workers as tasks of a shared pool instead of dedicated threads (nullptr for threads, the default).
+		// Each worker occupies a pool worker until stop(), so the pool needs at least as many workers as the ring has stage threads.
+		// Thread options (pinning, names) are the pool's. Can only be changed while the ring is stopped.
+		bool set_executor(core0::executor* pool) {
+			if (m_run) return false;
+			m_pool = pool;
 			return true;
 		}
 
 		// Starts the ring.
 		bool start(const cb_on_submit& on_submit, const cb_on_complete& on_complete) {
 			if (m_run) return false;
-			else m_run = true;
-			core0::auto_reset_event evt_submit[m_num_submit_thr], evt_complete[m_num_complete_thr];
 
 			// The submitter thread dequeues the submission queue, executes a user action and then enqueues to the completion queue.
+			// The completer thread dequeues the completion queue, executes a user action and then enqueues to the submission queue.
 			m_on_submit = on_submit;
-			for (auto thr_index = 0; thr_index < m_num_submit_thr; thr_index++) {
-				m_submitter[thr_index] = std::thread([&, thr_index]{
-					evt_submit[thr_index].set();
-					while(m_run) {
-						// Get an item from the submission queue.
-						if constexpr (I == io_ring_mode::blocking) {
-							constexpr int64_t wait_timeout_usec = 10000;
-							if (!m_submission_queue->wait_dequeue_timed(m_submitter_cur_item, wait_timeout_usec)) {
-								if (m_run) continue;
-								else break;
-							}
-						}
-						else {
-							if (!m_submission_queue->try_dequeue(m_submitter_cur_item)) {
-								if (m_run) continue;
-								else break;
-							}
-						}
-
-						// Check if we are still running, call the user submission callback and enqueue the item to the completion queue.
-						if (!m_run) break;
-						m_on_submit(m_submitter_cur_item);
-						m_completion_queue->enqueue(m_submitter_cur_item);
-					}
-				});
+			m_on_complete = on_complete;
+			if constexpr (is_bounded) {
+				if (m_window_size) {
+					this->resequence();
+					return this->start_workers(
+						[this](worker_counters& counters) { this->run_submit_ordered(counters); },
+						[this](worker_counters& counters) { this->run_complete_ordered(counters); });
+				}
 			}
+			return this->start_workers(
+				[this](worker_counters& counters) { this->run_stage(*m_submission_queue, *m_completion_queue, m_on_submit, counters, true); },
+				[this](worker_counters& counters) { this->run_stage(*m_completion_queue, *m_submission_queue, m_on_complete, counters, false); });
+		}
 
-			// The completer thread dequeues the completion queue, executes ua ser action and then enqueues to the submission queue.
-			m_on_complete = on_complete;
-			for (auto thr_index = 0; thr_index < m_num_complete_thr; thr_index++) {
-				m_completer[thr_index] = std::thread([&, thr_index]{
-					evt_complete[thr_index].set();
-					while(m_run) {
-						// Get an item from the completion queue.
-						if constexpr (I == io_ring_mode::blocking) {
-							constexpr int64_t wait_timeout_usec = 10000;
-							if (!m_completion_queue->wait_dequeue_timed(m_completer_cur_item, wait_timeout_usec)) {
-								if (m_run) continue;
-								else break;
-							}
-						}
-						else {
-							if (!m_completion_queue->try_dequeue(m_completer_cur_item)) {
-								if (m_run) continue;
-								else break;
-							}
-						}
-
-						// Check if we are still running, call the user completion callback and enqueue the item back to the submission queue.
-						if (!m_run) break;
-						m_on_complete(m_completer_cur_item);
-						m_submission_queue->enqueue(m_completer_cur_item);
-					}
+		// Starts the submit stage only, the user (e.g. a coroutine, see next()) completes the items.
+		// Completed items are taken with try_next() and must be given back with recycle() once done with.
+		bool start_submit_only(const cb_on_submit& on_submit) {
+			if (m_run || m_window_size) return false;
+			m_on_submit = on_submit;
+			return this->start_workers(
+				[this](worker_counters& counters) { this->run_stage(*m_submission_queue, *m_completion_queue, m_on_submit, counters, true, true); },
+				nullptr);
+		}
+
+		// Takes a completed item in the submit only mode, bounded rings return handles (see slot()).
+		bool try_next(batch_item& item) {
+			return m_completion_queue->try_dequeue(item);
+		}
+
+		// Gives an item back to the submit stage.
+		bool recycle(batch_item item) {
+			return m_submission_queue->enqueue(std::move(item));
+		}
+
+#ifdef __linux__
+		// Awaits the next completed item in the submit only mode, from a coroutine running on a core0::co::scheduler:
+		// while (true) {
+		// 	auto h = co_await ring.next();
+		// 	consume(ring.slot(h));
+		// 	ring.recycle(h);
+		// }
+		// A ring has a single awaiting consumer at a time.
+		class next_awaiter {
+		public:
+			explicit next_awaiter(io_ring& ring) : m_ring(ring) {}
+			bool await_ready() { return m_ring.try_next(m_item); }
+			bool await_suspend(std::coroutine_handle<> handle) {
+				m_handle = handle;
+				m_sched = core0::co::scheduler::current();
+				return !this->arm();
+			}
+			batch_item await_resume() { return std::move(m_item); }
+
+		private:
+			friend class io_ring;
+
+			// Publishes the waiter and checks the queue once more, the submitter checks for a waiter after it enqueued,
+			// so either we see the item or the submitter sees us. Returns true if we got an item and nobody else will resume us.
+			bool arm() {
+				m_ring.m_next_waiter.store(this);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!m_ring.try_next(m_item)) return false;
+				m_have = true;
+				return m_ring.m_next_waiter.exchange(nullptr) == this;
+			}
+
+			// Called by the submitter which claimed the waiter.
+			void notify() {
+				m_sched->post([this] {
+					if (m_have || m_ring.try_next(m_item) || this->arm()) m_handle.resume();
 				});
 			}
 
-			// Wait until all threads actually start before returning.
-			for (auto thr_index = 0; thr_index < m_num_complete_thr; thr_index++) evt_complete[thr_index].wait();
-			for (auto thr_index = 0; thr_index < m_num_submit_thr; thr_index++) evt_submit[thr_index].wait();
-			return true;
+			io_ring& m_ring;
+			batch_item m_item{};
+			bool m_have = false;
+			std::coroutine_handle<> m_handle;
+			core0::co::scheduler* m_sched = nullptr;
+		};
+		next_awaiter next() {
+			return next_awaiter(*this);
+		}
+#endif
+
+		// Starts the ring in batch mode.
+		// Each worker moves up to max_batch_size items per queue operation and calls its callback once for all of them,
+		// which amortizes the queue synchronization and the callback dispatch over the batch.
+		bool start_batch(const cb_on_submit_batch& on_submit_batch, const cb_on_complete_batch& on_complete_batch, const size_t max_batch_size = 64) {
+			if (m_run || m_window_size) return false;
+			m_on_submit_batch = on_submit_batch;
+			m_on_complete_batch = on_complete_batch;
+			m_max_batch_size = max_batch_size ? max_batch_size : 1;
+			return this->start_workers(
+				[this](worker_counters& counters) { this->run_stage_batch(*m_submission_queue, *m_completion_queue, m_on_submit_batch, counters, true); },
+				[this](worker_counters& counters) { this->run_stage_batch(*m_completion_queue, *m_submission_queue, m_on_complete_batch, counters, false); });
 		}
 
 		// Stops the ring.
 		void stop() {
 			// Deassert the run flag and wait for the threads to finish.
 			m_run = false;
+			if (m_pool_workers.load()) m_pool_done.wait();
 
 			for (auto thr_index = 0; thr_index < m_num_submit_thr; thr_index++) {
 				if (m_submitter[thr_index].joinable()) {
@@ -131,6 +475,19 @@ namespace core1::buffer_utils {
 					m_completer[thr_index].join();
 				}
 			}
+
+			// Items taken while stopping go back to their source queue.
+			if constexpr (is_spsc) {
+				m_submission_queue->enqueue_bulk(m_stopped_items[0].begin(), m_stopped_items[0].size());
+				m_completion_queue->enqueue_bulk(m_stopped_items[1].begin(), m_stopped_items[1].size());
+				m_stopped_items[0].clear();
+				m_stopped_items[1].clear();
+			}
+
+			// Items parked in the reorder window go back to the completion queue.
+			if constexpr (is_bounded) {
+				if (m_window_size) this->resequence();
+			}
 		}
 
 		// Returns an approximate number of items in the ring.
@@ -138,15 +495,332 @@ namespace core1::buffer_utils {
 			return m_submission_queue->size_approx() + m_completion_queue->size_approx();
 		}
 
+		// Returns how often each wait phase was hit (can be called from any thread while the ring is running).
+		io_ring_wait_stats get_wait_stats() const {
+			io_ring_wait_stats stats;
+			for (auto thr_index = 0; thr_index < m_num_submit_thr; thr_index++) stats.submit += m_counters[thr_index].waits.snapshot();
+			for (auto thr_index = 0; thr_index < m_num_complete_thr; thr_index++) stats.complete += m_counters[m_num_submit_thr + thr_index].waits.snapshot();
+			return stats;
+		}
+
+		// Returns a snapshot of the ring statistics (can be called from any thread while the ring is running).
+		// Each stage input queue is fed by the other stage, so its high water mark is tracked by the other stage workers.
+		io_ring_stats get_stats() const {
+			io_ring_stats stats;
+			for (auto thr_index = 0; thr_index < m_num_submit_thr + m_num_complete_thr; thr_index++) {
+				const auto& counters = m_counters[thr_index];
+				const bool is_submitter = thr_index < m_num_submit_thr;
+				auto& stage = is_submitter ? stats.submit : stats.complete;
+				auto& next_stage = is_submitter ? stats.complete : stats.submit;
+				stage.items += counters.items.load(std::memory_order_relaxed);
+				stage.callback_ns += counters.callback_ns.load(std::memory_order_relaxed);
+				stage.wait += counters.waits.snapshot();
+				next_stage.queue_high_water = std::max<size_t>(next_stage.queue_high_water, counters.dst_high_water.load(std::memory_order_relaxed));
+				if (!is_submitter) stats.latency_ns += counters.latency_ns.snapshot();
+			}
+			return stats;
+		}
+
 	private:
-		std::atomic_bool m_run;
+		// Items travel through the queues either as shared pointers or as handles to the preallocated slots.
+		using queue_item = batch_item;
+		using queue_type = std::conditional_t<is_spsc, core0::spsc_queue<queue_item>, moodycamel::BlockingConcurrentQueue<queue_item>>;
+		using worker_counters = detail::worker_counters;
+
+		// Submits all the preallocated slots.
+		void prime() requires (is_bounded) {
+			for (handle h = 0; h < m_queue_size; h++) m_submission_queue->enqueue(h);
+		}
+
+		item_type& resolve(queue_item& item) {
+			if constexpr (is_bounded) return m_slots[item];
+			else return item;
+		}
+
+		// Spawns the worker threads and waits until all of them actually start (no completer threads if completer is nullptr).
+		template <typename Submitter, typename Completer>
+		bool start_workers(const Submitter& submitter, const Completer& completer) {
+			if (m_run) return false;
+			else m_run = true;
+			constexpr bool has_completer = !std::is_same_v<Completer, std::nullptr_t>;
+			const auto num_complete_thr = has_completer ? m_num_complete_thr : 0;
+			if (m_pool) {
+				if (m_pool->size() < static_cast<size_t>(m_num_submit_thr + num_complete_thr)) {
+					m_run = false;
+					return false;
+				}
+				m_pool_done.reset();
+				m_pool_workers = m_num_submit_thr + num_complete_thr;
+				for (auto thr_index = 0; thr_index < m_num_submit_thr; thr_index++) {
+					m_pool->post([this, submitter, thr_index] {
+						submitter(m_counters[thr_index]);
+						this->pool_worker_done();
+					});
+				}
+				if constexpr (has_completer) {
+					for (auto thr_index = 0; thr_index < num_complete_thr; thr_index++) {
+						m_pool->post([this, completer, thr_index] {
+							completer(m_counters[m_num_submit_thr + thr_index]);
+							this->pool_worker_done();
+						});
+					}
+				}
+				return true;
+			}
+			core0::auto_reset_event evt_submit[m_num_submit_thr], evt_complete[m_num_complete_thr];
+			for (auto thr_index = 0; thr_index < m_num_submit_thr; thr_index++) {
+				m_submitter[thr_index] = std::thread([&, submitter, thr_index]{
+					detail::configure_this_thread(m_thread_options.submit_cpus, thr_index, this->thread_name(".s", thr_index));
+					evt_submit[thr_index].set();
+					submitter(m_counters[thr_index]);
+				});
+			}
+			for (auto thr_index = 0; thr_index < num_complete_thr; thr_index++) {
+				m_completer[thr_index] = std::thread([&, completer, thr_index]{
+					detail::configure_this_thread(m_thread_options.complete_cpus, thr_index, this->thread_name(".c", thr_index));
+					evt_complete[thr_index].set();
+					if constexpr (has_completer) completer(m_counters[m_num_submit_thr + thr_index]);
+				});
+			}
+			for (auto thr_index = 0; thr_index < num_complete_thr; thr_index++) evt_complete[thr_index].wait();
+			for (auto thr_index = 0; thr_index < m_num_submit_thr; thr_index++) evt_submit[thr_index].wait();
+			return true;
+		}
+
+		void pool_worker_done() {
+			if (m_pool_workers.fetch_sub(1) == 1) m_pool_done.set();
+		}
+
+		std::string thread_name(const char* stage, const size_t thr_index) const {
+			if (m_thread_options.name.empty()) return "";
+			return m_thread_options.name + stage + std::to_string(thr_index);
+		}
+
+		// Returns items taken while stopping to their source queue.
+		// The only producer of a spsc queue is the other stage, so they are kept aside until stop() joined the workers.
+		void give_back(queue_type& src, queue_item* items, const size_t count) {
+			if constexpr (is_spsc) {
+				auto& stopped_items = m_stopped_items[&src == m_submission_queue.get() ? 0 : 1];
+				stopped_items.insert(stopped_items.end(), std::make_move_iterator(items), std::make_move_iterator(items + count));
+			}
+			else {
+				src.enqueue_bulk(std::make_move_iterator(items), count);
+			}
+		}
+
+		bool dequeue(queue_type& queue, queue_item& item, worker_counters& counters) {
+			return detail::wait_for_items(
+				I,
+				m_wait_policy,
+				[&] { return queue.try_dequeue(item); },
+				[&](const i64 timeout_usec) { return queue.wait_dequeue_timed(item, timeout_usec); },
+				counters.waits);
+		}
+
+		size_t dequeue_bulk(queue_type& queue, queue_item* items, worker_counters& counters) {
+			size_t count = 0;
+			detail::wait_for_items(
+				I,
+				m_wait_policy,
+				[&] { return (count = queue.try_dequeue_bulk(items, m_max_batch_size)) > 0; },
+				[&](const i64 timeout_usec) { return (count = queue.wait_dequeue_bulk_timed(items, m_max_batch_size, timeout_usec)) > 0; },
+				counters.waits);
+			return count;
+		}
+
+		// A stage dequeues an item from its source queue, calls the user callback and enqueues the item to its destination queue.
+		// The item being processed is local to the thread, so any number of threads can run the same stage.
+		void run_stage(queue_type& src, queue_type& dst, const std::function<void(item_type&)>& on_item, worker_counters& counters, const bool is_submitter, const bool notify_next = false) {
+			queue_item item{};
+			while (m_run) {
+				if (!this->dequeue(src, item, counters)) continue;
+
+				// Check if we are still running (an item taken while stopping is returned so it won't leak from the ring).
+				if (!m_run) {
+					this->give_back(src, &item, 1);
+					break;
+				}
+				if (!m_stats_enabled) {
+					on_item(this->resolve(item));
+					dst.enqueue(std::move(item));
+				}
+				else {
+					const i64 start_ns = this->stats_begin(&item, 1, is_submitter);
+					on_item(this->resolve(item));
+					this->stats_end(&item, 1, is_submitter, start_ns, counters);
+					dst.enqueue(std::move(item));
+					counters.track_high_water(dst.size_approx());
+				}
+				if (notify_next) this->notify_next();
+				worker_counters::add(counters.items, 1);
+			}
+		}
+
+		// Wakes a consumer awaiting next(), if any.
+		void notify_next() {
+#ifdef __linux__
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!m_next_waiter.load(std::memory_order_relaxed)) return;
+			if (auto* waiter = m_next_waiter.exchange(nullptr)) waiter->notify();
+#endif
+		}
+
+		// Same as run_stage, but moves up to m_max_batch_size items at a time.
+		void run_stage_batch(queue_type& src, queue_type& dst, const std::function<void(std::span<batch_item>)>& on_batch, worker_counters& counters, const bool is_submitter) {
+			std::vector<queue_item> items(m_max_batch_size);
+			while (m_run) {
+				const size_t count = this->dequeue_bulk(src, items.data(), counters);
+				if (!count) continue;
+				if (!m_run) {
+					this->give_back(src, items.data(), count);
+					break;
+				}
+				if (!m_stats_enabled) {
+					on_batch(std::span<batch_item>(items.data(), count));
+					dst.enqueue_bulk(std::make_move_iterator(items.begin()), count);
+				}
+				else {
+					const i64 start_ns = this->stats_begin(items.data(), count, is_submitter);
+					on_batch(std::span<batch_item>(items.data(), count));
+					this->stats_end(items.data(), count, is_submitter, start_ns, counters);
+					dst.enqueue_bulk(std::make_move_iterator(items.begin()), count);
+					counters.track_high_water(dst.size_approx());
+				}
+				worker_counters::add(counters.items, count);
+			}
+		}
+
+		// Ordered submitter: numbers the item it takes and waits while it is a full window ahead of the oldest unreleased item.
+		void run_submit_ordered(worker_counters& counters) requires (is_bounded) {
+			queue_item item{};
+			while (m_run) {
+				if (!this->dequeue(*m_submission_queue, item, counters)) continue;
+				const u64 seq = m_next_seq.fetch_add(1, std::memory_order_relaxed);
+				m_seq[item] = seq;
+				for (unsigned spins = 0; seq - m_released.load(std::memory_order_acquire) >= m_window_size && m_run; spins++) {
+					if (spins < m_wait_policy.spin_iterations) core0::cpu_relax();
+					else std::this_thread::yield();
+				}
+				if (!m_run) {
+					this->give_back(*m_submission_queue, &item, 1);
+					break;
+				}
+				const i64 start_ns = m_stats_enabled ? this->stats_begin(&item, 1, true) : 0;
+				m_on_submit(m_slots[item]);
+				if (m_stats_enabled) this->stats_end(&item, 1, true, start_ns, counters);
+				m_completion_queue->enqueue(item);
+				worker_counters::add(counters.items, 1);
+			}
+		}
+
+		// Ordered completer: parks the item in the reorder window and releases whatever became contiguous.
+		// Releasing is owned by one completer at a time (try lock, nobody blocks on it), which is what keeps on_complete ordered.
+		void run_complete_ordered(worker_counters& counters) requires (is_bounded) {
+			queue_item item{};
+			while (m_run) {
+				if (!this->dequeue(*m_completion_queue, item, counters)) continue;
+				const u64 seq = m_seq[item];
+				auto& slot = m_window[seq & (m_window_size - 1)];
+				slot.item = item;
+				slot.tag.store(seq + 1);
+				while (!m_releasing.exchange(true)) {
+					u64 next = m_released.load(std::memory_order_relaxed);
+					while (m_window[next & (m_window_size - 1)].tag.load() == next + 1) {
+						queue_item ready = m_window[next & (m_window_size - 1)].item;
+						const i64 start_ns = m_stats_enabled ? this->stats_begin(&ready, 1, false) : 0;
+						m_on_complete(m_slots[ready]);
+						if (m_stats_enabled) this->stats_end(&ready, 1, false, start_ns, counters);
+						m_submission_queue->enqueue(ready);
+						worker_counters::add(counters.items, 1);
+						m_released.store(++next, std::memory_order_release);
+					}
+					m_releasing.store(false);
+
+					// Another completer may have parked the next item after we looked and before we let go.
+					if (m_window[next & (m_window_size - 1)].tag.load() != next + 1) break;
+				}
+			}
+		}
+
+		// Renumbers the items which wait for completion (e.g. left over by a stop), keeping their relative order.
+		void resequence() requires (is_bounded) {
+			std::vector<std::pair<u64, handle>> pending;
+			handle item;
+			while (m_completion_queue->try_dequeue(item)) pending.push_back({m_seq[item], item});
+			const u64 released = m_released.load();
+			for (size_t ii = 0; ii < m_window_size; ii++) {
+				const u64 tag = m_window[ii].tag.load();
+				if (tag > released) pending.push_back({tag - 1, m_window[ii].item});
+				m_window[ii].tag = 0;
+			}
+			std::sort(pending.begin(), pending.end());
+			for (size_t ii = 0; ii < pending.size(); ii++) {
+				m_seq[pending[ii].second] = ii;
+				m_completion_queue->enqueue(pending[ii].second);
+			}
+			m_next_seq = pending.size();
+			m_released = 0;
+		}
+
+		// Submitters stamp the items they take, so completers can measure the latency through the ring.
+		i64 stats_begin(const queue_item* items, const size_t count, const bool is_submitter) {
+			const i64 start_ns = detail::now_ns();
+			if constexpr (is_bounded) {
+				if (is_submitter) {
+					for (size_t ii = 0; ii < count; ii++) m_stamps[items[ii]] = start_ns;
+				}
+			}
+			return start_ns;
+		}
+		void stats_end(const queue_item* items, const size_t count, const bool is_submitter, const i64 start_ns, worker_counters& counters) {
+			const i64 end_ns = detail::now_ns();
+			worker_counters::add(counters.callback_ns, end_ns - start_ns);
+			if constexpr (is_bounded) {
+				if (!is_submitter) {
+					for (size_t ii = 0; ii < count; ii++) {
+						auto& stamp = m_stamps[items[ii]];
+						if (stamp) counters.latency_ns.record(end_ns - stamp);
+						stamp = 0;
+					}
+				}
+			}
+		}
+
+		std::atomic_bool m_run{false};
 		size_t m_queue_size;
 		std::vector<std::thread> m_submitter, m_completer;
-		std::shared_ptr<T> m_submitter_cur_item, m_completer_cur_item;
+		core0::executor* m_pool = nullptr;
+		std::atomic<unsigned> m_pool_workers{0};
+		core0::manual_reset_event m_pool_done;
 		unsigned char m_num_submit_thr, m_num_complete_thr;
-		std::unique_ptr<moodycamel::BlockingConcurrentQueue<std::shared_ptr<T>>> m_submission_queue, m_completion_queue;
+		std::unique_ptr<queue_type> m_submission_queue, m_completion_queue;
+		detail::slot_array<T> m_slots;
+		core0::spin_wait_policy m_wait_policy;
+		io_ring_thread_options m_thread_options;
+		std::unique_ptr<worker_counters[]> m_counters;
+		std::unique_ptr<i64[]> m_stamps;
+		bool m_stats_enabled = false;
+
+		// Ordered mode state, the window slot tag holds the sequence number + 1 of the item parked in it.
+		struct window_slot {
+			std::atomic<u64> tag{0};
+			handle item = 0;
+		};
+		size_t m_window_size = 0;
+		std::unique_ptr<window_slot[]> m_window;
+		std::unique_ptr<u64[]> m_seq;
+		alignas(64) std::atomic<u64> m_next_seq{0};
+		alignas(64) std::atomic<u64> m_released{0};
+		alignas(64) std::atomic<bool> m_releasing{false};
 		cb_on_submit m_on_submit = {};
 		cb_on_complete m_on_complete = {};
+		cb_on_submit_batch m_on_submit_batch = {};
+		cb_on_complete_batch m_on_complete_batch = {};
+#ifdef __linux__
+		std::atomic<next_awaiter*> m_next_waiter{nullptr};
+#endif
+		size_t m_max_batch_size = 1;
+		std::vector<queue_item> m_stopped_items[2];
 	};
 }
 #endif
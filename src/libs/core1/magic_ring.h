@@ -0,0 +1,96 @@
+#ifndef _MAGIC_RING_H
+#define _MAGIC_RING_H
+
+#ifdef __linux__
+#include <atomic>
+#include <bit>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "core0/types.h"
+#include "numa_utils.h"
+
+namespace core1::buffer_utils {
+	// A single producer single consumer byte ring whose pages are mapped twice, back to back, so the readable and
+	// the writable regions are always contiguous: a record which wraps around the end of the ring can be parsed
+	// (or read() / write() to a descriptor) through a plain pointer range, without copying it to a scratch buffer.
+	// The capacity is rounded up to a power of two multiple of the page size.
+	// Example use:
+	// core1::buffer_utils::magic_ring ring(1 << 20);
+	// producer: auto n = read(fd, ring.write_ptr(), ring.writable()); if (n > 0) ring.commit(n);
+	// consumer: auto used = parse(ring.read_ptr(), ring.readable()); ring.consume(used);
+	class magic_ring {
+	public:
+		explicit magic_ring(const size_t min_capacity) {
+			const size_t capacity = std::bit_ceil(std::max(min_capacity, core1::memory::page_size()));
+			const int fd = memfd_create("magic_ring", MFD_CLOEXEC);
+			if (fd < 0) return;
+			if (ftruncate(fd, static_cast<off_t>(capacity)) == 0) {
+				// Reserve twice the address space, then map the same pages over both halves.
+				auto* base = static_cast<unsigned char*>(mmap(nullptr, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+				if (base != MAP_FAILED) {
+					if (mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+						mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+						m_base = base;
+						m_capacity = capacity;
+					}
+					else {
+						munmap(base, 2 * capacity);
+					}
+				}
+			}
+			close(fd);
+		}
+		~magic_ring() {
+			if (m_base) munmap(m_base, 2 * m_capacity);
+		}
+		magic_ring(const magic_ring&) = delete;
+		magic_ring& operator=(const magic_ring&) = delete;
+
+		operator bool() const { return m_base != nullptr; }
+		size_t capacity() const { return m_capacity; }
+
+		// Producer side: writable() contiguous bytes can be written at write_ptr(), commit() publishes them.
+		unsigned char* write_ptr() const { return m_base + (m_tail.load(std::memory_order_relaxed) & (m_capacity - 1)); }
+		size_t writable() {
+			return m_capacity - static_cast<size_t>(m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire));
+		}
+		void commit(const size_t count) { m_tail.store(m_tail.load(std::memory_order_relaxed) + count, std::memory_order_release); }
+
+		// Copies as much of data as fits, returns the number of bytes written.
+		size_t write(const void* data, const size_t len) {
+			const size_t count = std::min(len, this->writable());
+			memcpy(this->write_ptr(), data, count);
+			this->commit(count);
+			return count;
+		}
+
+		// Consumer side: readable() contiguous bytes can be read at read_ptr(), consume() gives them back to the producer.
+		const unsigned char* read_ptr() const { return m_base + (m_head.load(std::memory_order_relaxed) & (m_capacity - 1)); }
+		size_t readable() {
+			return static_cast<size_t>(m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_relaxed));
+		}
+		void consume(const size_t count) { m_head.store(m_head.load(std::memory_order_relaxed) + count, std::memory_order_release); }
+
+		// Copies up to len bytes out of the ring, returns the number of bytes read.
+		size_t read(void* data, const size_t len) {
+			const size_t count = std::min(len, this->readable());
+			memcpy(data, this->read_ptr(), count);
+			this->consume(count);
+			return count;
+		}
+
+		// Approximate number of bytes in the ring (any thread).
+		size_t size_approx() const { return static_cast<size_t>(m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_relaxed)); }
+
+	private:
+		unsigned char* m_base = nullptr;
+		size_t m_capacity = 0;
+		// Positions only grow, each is written by one side only.
+		alignas(64) std::atomic<u64> m_head{0};
+		alignas(64) std::atomic<u64> m_tail{0};
+	};
+}
+#endif
+#endif
@@ -0,0 +1,58 @@
+#ifndef _MEMORY_NUMA_UTILS_H
+#define _MEMORY_NUMA_UTILS_H
+
+#include <string>
+#include <filesystem>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+// Minimal NUMA helpers based on sysfs and the mbind system call, so we do not depend on libnuma.
+namespace core1::memory {
+	inline size_t page_size() {
+#ifdef __linux__
+		static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		return size;
+#else
+		return 4096;
+#endif
+	}
+
+	// Returns the NUMA node of a cpu or -1 if unknown.
+	inline int numa_node_of_cpu(const int cpu) {
+#ifdef __linux__
+		std::error_code ec;
+		const std::filesystem::path cpu_dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+		for (const auto& entry : std::filesystem::directory_iterator(cpu_dir, ec)) {
+			const auto name = entry.path().filename().string();
+			if (name.rfind("node", 0) == 0 && name.size() > 4) {
+				try {
+					return std::stoi(name.substr(4));
+				}
+				catch (...) {
+					return -1;
+				}
+			}
+		}
+#endif
+		return -1;
+	}
+
+	// Binds a page aligned memory range to a NUMA node.
+	// Pages which were already touched are migrated if move_pages is set, otherwise only new faults follow the policy.
+	inline bool bind_to_numa_node(void* addr, const size_t len, const int node, const bool move_pages = true) {
+#ifdef __linux__
+		constexpr int mpol_bind = 2;
+		constexpr unsigned mpol_mf_move = 1 << 1;
+		constexpr size_t bits_per_word = 8 * sizeof(unsigned long);
+		unsigned long node_mask[16] = {};
+		if (!addr || node < 0 || static_cast<size_t>(node) >= bits_per_word * 16) return false;
+		node_mask[node / bits_per_word] |= 1UL << (node % bits_per_word);
+		return syscall(SYS_mbind, addr, len, mpol_bind, node_mask, bits_per_word * 16 + 1, move_pages ? mpol_mf_move : 0) == 0;
+#else
+		return false;
+#endif
+	}
+}
+#endif
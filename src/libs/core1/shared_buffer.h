@@ -0,0 +1,265 @@
+#ifndef _MEMORY_SHARED_BUFFER_H
+#define _MEMORY_SHARED_BUFFER_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+#include "core0/types.h"
+#include "aligned_transfer.h"
+#include "posix_memalign_xp.h"
+
+namespace core1::memory {
+#ifdef _WIN32
+	struct iovec_t {
+		void* iov_base;
+		size_t iov_len;
+	};
+#else
+	using iovec_t = ::iovec;
+#endif
+
+	namespace detail {
+		// Reference count and release of a shared_buffer, destroy() runs when the last reference goes away.
+		struct buffer_control {
+			std::atomic<u32> refs{1};
+			unsigned char* data = nullptr;
+			size_t size = 0;
+			void (*destroy)(buffer_control*) = nullptr;
+		};
+	}
+
+	class buffer_slice;
+
+	// A reference counted buffer: copies share the memory, which is released with the last copy.
+	// Slices of it can be handed to several consumers (framing, fan out) without copying the bytes.
+	// Example use:
+	// auto block = core1::memory::shared_buffer::allocate(4096);
+	// auto len = read(fd, block.data(), block.size());
+	// auto header = block.slice(0, 16);
+	// auto payload = block.slice(16, len - 16);    // block can go away, the slices keep the memory alive
+	class shared_buffer {
+	public:
+		shared_buffer() noexcept {}
+		shared_buffer(const shared_buffer& other) noexcept : m_control(other.m_control) { this->add_ref(); }
+		shared_buffer(shared_buffer&& other) noexcept : m_control(std::exchange(other.m_control, nullptr)) {}
+		shared_buffer& operator=(const shared_buffer& other) noexcept {
+			if (m_control != other.m_control) {
+				this->release();
+				m_control = other.m_control;
+				this->add_ref();
+			}
+			return *this;
+		}
+		shared_buffer& operator=(shared_buffer&& other) noexcept {
+			if (this != &other) {
+				this->release();
+				m_control = std::exchange(other.m_control, nullptr);
+			}
+			return *this;
+		}
+		~shared_buffer() { this->release(); }
+
+		// One allocation for the reference count and the bytes (which are not zeroed).
+		static shared_buffer allocate(const size_t size, const size_t alignment = 0) {
+			const size_t align = std::max(alignment, alignof(std::max_align_t));
+			const size_t header = (sizeof(detail::buffer_control) + align - 1) / align * align;
+			void* raw = nullptr;
+			if (posix_memalign(&raw, align, header + size)) return {};
+			auto* control = new (raw) detail::buffer_control;
+			control->data = static_cast<unsigned char*>(raw) + header;
+			control->size = size;
+			control->destroy = [](detail::buffer_control* control) {
+				control->~buffer_control();
+				free(control);
+			};
+			return shared_buffer(control);
+		}
+
+		// Takes over a transfer (e.g. a pooled_transfer, which goes back to its pool with the last reference).
+		// The shared bytes are the used part of the transfer, or all of its capacity if used is 0.
+		template <typename TRANSFER>
+		requires std::is_base_of_v<aligned_transfer<false>, TRANSFER>
+		static shared_buffer adopt(TRANSFER&& transfer) {
+			struct adopted : detail::buffer_control {
+				explicit adopted(TRANSFER&& transfer) : transfer(std::move(transfer)) {}
+				TRANSFER transfer;
+			};
+			auto* control = new adopted(std::move(transfer));
+			control->data = control->transfer.buffer;
+			control->size = control->transfer.used > 0 ? static_cast<size_t>(control->transfer.used) : control->transfer.capacity;
+			control->destroy = [](detail::buffer_control* control) { delete static_cast<adopted*>(control); };
+			return shared_buffer(control);
+		}
+
+		// Shares memory owned elsewhere, on_release runs with the last reference (e.g. to give a DMA buffer back).
+		static shared_buffer wrap(unsigned char* data, const size_t size, std::function<void()> on_release) {
+			struct wrapped : detail::buffer_control {
+				std::function<void()> on_release;
+			};
+			auto* control = new wrapped;
+			control->data = data;
+			control->size = size;
+			control->on_release = std::move(on_release);
+			control->destroy = [](detail::buffer_control* control) {
+				auto* w = static_cast<wrapped*>(control);
+				if (w->on_release) w->on_release();
+				delete w;
+			};
+			return shared_buffer(control);
+		}
+
+		operator bool() const { return m_control != nullptr; }
+		unsigned char* data() const { return m_control ? m_control->data : nullptr; }
+		size_t size() const { return m_control ? m_control->size : 0; }
+		u32 use_count() const { return m_control ? m_control->refs.load(std::memory_order_relaxed) : 0; }
+
+		// A view of [offset, offset + len) which shares the buffer, len is clamped to the end of the buffer.
+		buffer_slice slice(const size_t offset, const size_t len = static_cast<size_t>(-1)) const;
+
+	private:
+		friend class buffer_slice;
+		explicit shared_buffer(detail::buffer_control* control) noexcept : m_control(control) {}
+
+		void add_ref() {
+			if (m_control) m_control->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+		void release() {
+			if (m_control && m_control->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) m_control->destroy(m_control);
+			m_control = nullptr;
+		}
+
+		detail::buffer_control* m_control = nullptr;
+	};
+
+	// A read only view of part of a shared_buffer, which it keeps alive. Copying a slice copies no bytes.
+	class buffer_slice {
+	public:
+		buffer_slice() noexcept {}
+		buffer_slice(const shared_buffer& buffer) : buffer_slice(buffer, 0, buffer.size()) {}
+		buffer_slice(shared_buffer buffer, const size_t offset, const size_t len) : m_buffer(std::move(buffer)) {
+			const size_t size = m_buffer.size();
+			m_offset = std::min(offset, size);
+			m_len = std::min(len, size - m_offset);
+		}
+
+		const unsigned char* data() const { return m_buffer.data() + m_offset; }
+		size_t size() const { return m_len; }
+		bool empty() const { return m_len == 0; }
+		const unsigned char& operator[](const size_t index) const { return this->data()[index]; }
+		const shared_buffer& buffer() const { return m_buffer; }
+
+		buffer_slice slice(const size_t offset, const size_t len = static_cast<size_t>(-1)) const {
+			const size_t start = std::min(offset, m_len);
+			return buffer_slice(m_buffer, m_offset + start, std::min(len, m_len - start));
+		}
+
+		// Drops bytes from the front / back of the view.
+		void remove_prefix(const size_t count) {
+			const size_t n = std::min(count, m_len);
+			m_offset += n;
+			m_len -= n;
+		}
+		void remove_suffix(const size_t count) { m_len -= std::min(count, m_len); }
+
+		iovec_t as_iovec() const { return {const_cast<unsigned char*>(this->data()), m_len}; }
+
+	private:
+		shared_buffer m_buffer;
+		size_t m_offset = 0;
+		size_t m_len = 0;
+	};
+
+	inline buffer_slice shared_buffer::slice(const size_t offset, const size_t len) const {
+		return buffer_slice(*this, offset, len);
+	}
+
+	// A list of slices which is written out with one gathered call (writev, sendmsg, io_uring IORING_OP_WRITEV).
+	// Example use:
+	// core1::memory::buffer_chain chain;
+	// chain.append(header);
+	// chain.append(payload);
+	// auto written = writev(fd, chain.iov(), chain.iov_count());
+	// if (written > 0) chain.consume(written);   // what is left after a short write
+	class buffer_chain {
+	public:
+		void append(buffer_slice slice) {
+			if (slice.empty()) return;
+			m_bytes += slice.size();
+			m_slices.push_back(std::move(slice));
+			m_iov_valid = false;
+		}
+		void append(const buffer_chain& other) {
+			for (const auto& slice : other.m_slices) this->append(slice);
+		}
+		void clear() {
+			m_slices.clear();
+			m_iov.clear();
+			m_bytes = 0;
+			m_iov_valid = false;
+		}
+
+		// Total bytes / number of slices.
+		size_t size() const { return m_bytes; }
+		size_t count() const { return m_slices.size(); }
+		bool empty() const { return m_bytes == 0; }
+		const std::vector<buffer_slice>& slices() const { return m_slices; }
+
+		// The iovec array of the chain, valid until the chain is changed.
+		// Note writev / sendmsg take at most IOV_MAX (1024 on Linux) entries per call.
+		const iovec_t* iov() {
+			if (!m_iov_valid) {
+				m_iov.resize(m_slices.size());
+				for (size_t ii = 0; ii < m_slices.size(); ii++) m_iov[ii] = m_slices[ii].as_iovec();
+				m_iov_valid = true;
+			}
+			return m_iov.data();
+		}
+		int iov_count() const { return static_cast<int>(m_slices.size()); }
+
+		// Drops the first bytes of the chain, e.g. what a (partial) gathered write has sent.
+		void consume(size_t bytes) {
+			size_t done = 0;
+			while (done < m_slices.size() && bytes && bytes >= m_slices[done].size()) {
+				bytes -= m_slices[done].size();
+				m_bytes -= m_slices[done].size();
+				done++;
+			}
+			m_slices.erase(m_slices.begin(), m_slices.begin() + done);
+			if (bytes && !m_slices.empty()) {
+				const size_t n = std::min(bytes, m_slices.front().size());
+				m_slices.front().remove_prefix(n);
+				m_bytes -= n;
+			}
+			m_iov_valid = false;
+		}
+
+		// Copies up to max_len bytes of the chain into dst (for consumers which need contiguous bytes), returns the count.
+		size_t copy_to(unsigned char* dst, const size_t max_len) const {
+			size_t copied = 0;
+			for (const auto& slice : m_slices) {
+				const size_t n = std::min(slice.size(), max_len - copied);
+				memcpy(dst + copied, slice.data(), n);
+				copied += n;
+				if (copied == max_len) break;
+			}
+			return copied;
+		}
+
+	private:
+		std::vector<buffer_slice> m_slices;
+		std::vector<iovec_t> m_iov;
+		size_t m_bytes = 0;
+		bool m_iov_valid = false;
+	};
+}
+#endif
@@ -0,0 +1,366 @@
+#ifndef _MEMORY_TRANSFER_POOL_H
+#define _MEMORY_TRANSFER_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <bit>
+#include <algorithm>
+#include <stdlib.h>
+#include "core0/types.h"
+#include "aligned_transfer.h"
+#include "posix_memalign_xp.h"
+
+namespace core1::memory {
+	struct transfer_pool_stats {
+		u64 hits = 0;              // Served from a thread cache or the shared free lists.
+		u64 misses = 0;            // Served by the system allocator (empty pool or larger than the largest size class).
+		u64 returns = 0;           // Buffers given back to the pool.
+		u64 frees = 0;             // Buffers given back to the system allocator (the pool was over max_cached_bytes).
+		size_t cached_buffers = 0; // Buffers in the shared free lists (thread caches are not counted).
+		size_t cached_bytes = 0;
+		double hit_rate() const { return hits + misses ? static_cast<double>(hits) / static_cast<double>(hits + misses) : 0; }
+	};
+
+	namespace detail {
+		class transfer_pool_core;
+	}
+
+	// An aligned_transfer whose buffer comes from a transfer_pool and goes back to it when the transfer is destroyed.
+	// It can be used wherever an aligned_transfer<false> is expected (e.g. core2::io::async_file).
+	struct pooled_transfer : aligned_transfer<false> {
+		pooled_transfer() noexcept {}
+		pooled_transfer(pooled_transfer&& other) noexcept : aligned_transfer<false>(std::move(other)), pool(other.pool), size_class(other.size_class) {
+			other.pool = nullptr;
+		}
+		pooled_transfer& operator=(pooled_transfer&& other) noexcept {
+			if (this != &other) {
+				this->release();
+				if (buffer && capacity) free(buffer);
+				aligned_transfer<false>::operator=(std::move(other));
+				pool = other.pool;
+				size_class = other.size_class;
+				other.pool = nullptr;
+			}
+			return *this;
+		}
+		~pooled_transfer() override { this->release(); }
+
+	private:
+		friend class transfer_pool;
+		void release();
+		detail::transfer_pool_core* pool = nullptr;
+		unsigned size_class = 0;
+	};
+
+	namespace detail {
+		// Shared free list of one size class. It is behind a lock: a lock free stack would read the link of a buffer
+		// another thread may have popped and freed meanwhile. Threads move buffers in and out in batches from their caches,
+		// so the lock is not taken per acquire / release.
+		class buffer_bin {
+		public:
+			void push(unsigned char* const* buffers, const size_t count) {
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_buffers.insert(m_buffers.end(), buffers, buffers + count);
+				m_count.store(m_buffers.size(), std::memory_order_relaxed);
+			}
+			unsigned char* pop() {
+				std::lock_guard<std::mutex> lck(m_mtx);
+				if (m_buffers.empty()) return nullptr;
+				auto* buffer = m_buffers.back();
+				m_buffers.pop_back();
+				m_count.store(m_buffers.size(), std::memory_order_relaxed);
+				return buffer;
+			}
+			// Moves up to count buffers to dst, returns how many were moved.
+			size_t pop(std::vector<unsigned char*>& dst, const size_t count) {
+				if (!m_count.load(std::memory_order_relaxed)) return 0;
+				std::lock_guard<std::mutex> lck(m_mtx);
+				const size_t n = std::min(count, m_buffers.size());
+				dst.insert(dst.end(), m_buffers.end() - n, m_buffers.end());
+				m_buffers.resize(m_buffers.size() - n);
+				m_count.store(m_buffers.size(), std::memory_order_relaxed);
+				return n;
+			}
+			size_t size() const { return m_count.load(std::memory_order_relaxed); }
+
+		private:
+			std::mutex m_mtx;
+			std::vector<unsigned char*> m_buffers;
+			std::atomic<size_t> m_count{0};
+		};
+
+		struct transfer_pool_counters {
+			std::atomic<u64> hits{0};
+			std::atomic<u64> misses{0};
+			std::atomic<u64> returns{0};
+			std::atomic<u64> frees{0};
+			// Only the owning thread writes, so no read-modify-write is needed.
+			static void add(std::atomic<u64>& counter) { counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+		};
+
+		class transfer_pool_core : public std::enable_shared_from_this<transfer_pool_core> {
+		public:
+			transfer_pool_core(const size_t min_size, const size_t max_size, const size_t alignment, const size_t thread_cache_size, const size_t max_cached_bytes) :
+				m_min_shift(std::countr_zero(std::bit_ceil(std::max<size_t>(min_size, 64)))),
+				m_num_classes(std::bit_width(std::bit_ceil(std::max(max_size, min_size)) >> m_min_shift)),
+				m_alignment(alignment),
+				m_thread_cache_size(thread_cache_size),
+				m_max_cached_bytes(max_cached_bytes),
+				m_bins(m_num_classes) {}
+			~transfer_pool_core() { this->drain(); }
+
+			size_t class_size(const unsigned size_class) const { return size_t(1) << (m_min_shift + size_class); }
+			// Returns the size class of a capacity, or num_classes() if it is larger than the largest class.
+			unsigned class_of(const size_t capacity) const {
+				return capacity <= class_size(0) ? 0 : std::min<unsigned>(std::bit_width((capacity - 1) >> m_min_shift), m_num_classes);
+			}
+			unsigned num_classes() const { return m_num_classes; }
+			size_t alignment() const { return m_alignment; }
+
+			// Allocates like aligned_transfer does (alignment extra bytes), without zeroing.
+			unsigned char* allocate(const size_t size) const {
+				unsigned char* buffer = nullptr;
+				if (!m_alignment) buffer = static_cast<unsigned char*>(malloc(size));
+				else if (posix_memalign((void **)&buffer, m_alignment, size + m_alignment)) buffer = nullptr;
+				return buffer;
+			}
+
+			unsigned char* get(const unsigned size_class) {
+				auto& cache = this->local_cache();
+				auto& bin = cache.bins[size_class];
+				unsigned char* buffer = nullptr;
+				if (bin.empty()) {
+					// Refill half of the thread cache at once.
+					const size_t moved = m_bins[size_class].pop(bin, std::max<size_t>(m_thread_cache_size / 2, 1));
+					m_cached_bytes.fetch_sub(moved * class_size(size_class), std::memory_order_relaxed);
+				}
+				if (!bin.empty()) {
+					buffer = bin.back();
+					bin.pop_back();
+				}
+				if (buffer) {
+					transfer_pool_counters::add(cache.counters->hits);
+					return buffer;
+				}
+				transfer_pool_counters::add(cache.counters->misses);
+				return this->allocate(class_size(size_class));
+			}
+
+			void put(const unsigned size_class, unsigned char* buffer) {
+				auto& cache = this->local_cache();
+				auto& bin = cache.bins[size_class];
+				transfer_pool_counters::add(cache.counters->returns);
+				if (bin.size() >= m_thread_cache_size) {
+					// Hand half of the thread cache over to the other threads at once.
+					const size_t keep = m_thread_cache_size / 2;
+					this->push_shared(size_class, bin.data() + keep, bin.size() - keep, cache.counters);
+					bin.resize(keep);
+				}
+				if (m_thread_cache_size) bin.push_back(buffer);
+				else this->push_shared(size_class, &buffer, 1, cache.counters);
+			}
+
+			void prefill(const unsigned size_class, const size_t count) {
+				std::vector<unsigned char*> buffers;
+				buffers.reserve(count);
+				for (size_t ii = 0; ii < count; ii++) {
+					auto* buffer = this->allocate(class_size(size_class));
+					if (!buffer) break;
+					buffers.push_back(buffer);
+				}
+				m_cached_bytes.fetch_add(buffers.size() * class_size(size_class), std::memory_order_relaxed);
+				m_bins[size_class].push(buffers.data(), buffers.size());
+			}
+
+			transfer_pool_stats get_stats() {
+				transfer_pool_stats stats;
+				std::lock_guard<std::mutex> lck(m_mtx);
+				for (const auto* counters : m_counters) {
+					stats.hits += counters->hits.load(std::memory_order_relaxed);
+					stats.misses += counters->misses.load(std::memory_order_relaxed);
+					stats.returns += counters->returns.load(std::memory_order_relaxed);
+					stats.frees += counters->frees.load(std::memory_order_relaxed);
+				}
+				stats.hits += m_retired.hits;
+				stats.misses += m_retired.misses;
+				stats.returns += m_retired.returns;
+				stats.frees += m_retired.frees;
+				for (const auto& bin : m_bins) stats.cached_buffers += bin.size();
+				stats.cached_bytes = m_cached_bytes.load(std::memory_order_relaxed);
+				return stats;
+			}
+
+			// Frees the buffers of the shared free lists and of the calling thread cache.
+			void drain() {
+				for (unsigned size_class = 0; size_class < m_num_classes; size_class++) {
+					while (auto* buffer = m_bins[size_class].pop()) {
+						m_cached_bytes.fetch_sub(class_size(size_class), std::memory_order_relaxed);
+						free(buffer);
+					}
+				}
+			}
+			void drain_local() {
+				for (auto& cache : thread_caches().caches) {
+					if (cache.core.get() != this) continue;
+					for (auto& bin : cache.bins) {
+						for (auto* buffer : bin) free(buffer);
+						bin.clear();
+					}
+				}
+			}
+
+		private:
+			struct thread_cache {
+				std::shared_ptr<transfer_pool_core> core;
+				std::vector<std::vector<unsigned char*>> bins;
+				transfer_pool_counters* counters;
+			};
+
+			// The caches of a thread keep their pools alive, they go back to the shared free lists when the thread exits.
+			struct thread_cache_list {
+				std::vector<thread_cache> caches;
+				~thread_cache_list() {
+					for (auto& cache : caches) cache.core->retire(cache);
+				}
+			};
+			static thread_cache_list& thread_caches() {
+				static thread_local thread_cache_list list;
+				return list;
+			}
+
+			thread_cache& local_cache() {
+				auto& caches = thread_caches().caches;
+				for (auto& cache : caches) {
+					if (cache.core.get() == this) return cache;
+				}
+				thread_cache cache;
+				cache.core = this->shared_from_this();
+				cache.bins.resize(m_num_classes);
+				for (auto& bin : cache.bins) bin.reserve(m_thread_cache_size);
+				cache.counters = new transfer_pool_counters;
+				{
+					std::lock_guard<std::mutex> lck(m_mtx);
+					m_counters.push_back(cache.counters);
+				}
+				caches.push_back(std::move(cache));
+				return caches.back();
+			}
+
+			void retire(thread_cache& cache) {
+				for (unsigned size_class = 0; size_class < m_num_classes; size_class++) {
+					auto& bin = cache.bins[size_class];
+					this->push_shared(size_class, bin.data(), bin.size(), cache.counters);
+				}
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_retired.hits += cache.counters->hits;
+				m_retired.misses += cache.counters->misses;
+				m_retired.returns += cache.counters->returns;
+				m_retired.frees += cache.counters->frees;
+				m_counters.erase(std::find(m_counters.begin(), m_counters.end(), cache.counters));
+				delete cache.counters;
+			}
+
+			// Moves a batch of buffers to the shared free list under a single lock, the part over max_cached_bytes is freed.
+			void push_shared(const unsigned size_class, unsigned char* const* buffers, const size_t count, transfer_pool_counters* counters) {
+				if (!count) return;
+				const size_t size = class_size(size_class);
+				const size_t before = m_cached_bytes.fetch_add(count * size, std::memory_order_relaxed);
+				const size_t keep = before >= m_max_cached_bytes ? 0 : std::min(count, (m_max_cached_bytes - before) / size);
+				if (keep < count) {
+					m_cached_bytes.fetch_sub((count - keep) * size, std::memory_order_relaxed);
+					for (size_t ii = keep; ii < count; ii++) {
+						transfer_pool_counters::add(counters->frees);
+						free(buffers[ii]);
+					}
+				}
+				if (keep) m_bins[size_class].push(buffers, keep);
+			}
+
+			const unsigned m_min_shift;
+			const unsigned m_num_classes;
+			const size_t m_alignment;
+			const size_t m_thread_cache_size;
+			const size_t m_max_cached_bytes;
+			std::vector<buffer_bin> m_bins;
+			std::atomic<size_t> m_cached_bytes{0};
+			std::mutex m_mtx;
+			std::vector<transfer_pool_counters*> m_counters;
+			struct {
+				u64 hits = 0, misses = 0, returns = 0, frees = 0;
+			} m_retired;
+		};
+	}
+
+	// Recycles the buffers of aligned transfers, so a streaming path which keeps creating and destroying transfers
+	// does not go to the system allocator or zero memory which is about to be overwritten anyway.
+	// Buffers are kept in power of two size classes, each thread has a small cache per class in front of shared free lists
+	// (which it refills from and spills to in batches). Requests above the largest class are allocated and freed as is (and counted as misses).
+	// Transfers must not outlive their pool. Buffers cached by other threads are freed when those threads exit.
+	// Example use:
+	// core1::memory::transfer_pool pool;
+	// {
+	// 	auto transfer = pool.acquire(65536);    // transfer.buffer is 4096 aligned, its content is undefined
+	// 	...
+	// }                                        // the buffer is back in the pool
+	class transfer_pool {
+	public:
+		struct options {
+			options() {}
+			size_t min_size = 4096;                // Smallest size class (rounded up to a power of two).
+			size_t max_size = 4 << 20;             // Largest size class.
+			size_t alignment = 4096;               // Buffer alignment, 0 for malloc (same as aligned_transfer).
+			size_t thread_cache_size = 16;         // Buffers each thread caches per size class.
+			size_t max_cached_bytes = 256 << 20;   // Buffers returned beyond this (in the shared free lists) are freed.
+		};
+
+		explicit transfer_pool(const options& options = {}) :
+			m_core(std::make_shared<detail::transfer_pool_core>(options.min_size, options.max_size, options.alignment, options.thread_cache_size, options.max_cached_bytes)) {}
+		~transfer_pool() {
+			m_core->drain_local();
+			m_core->drain();
+		}
+		transfer_pool(const transfer_pool&) = delete;
+		transfer_pool& operator=(const transfer_pool&) = delete;
+
+		// Returns a transfer of at least capacity bytes (transfer.capacity is 0 if the allocation failed).
+		pooled_transfer acquire(const size_t capacity) {
+			pooled_transfer transfer;
+			transfer.alignment = m_core->alignment();
+			if (!capacity) return transfer;
+			const unsigned size_class = m_core->class_of(capacity);
+			if (size_class == m_core->num_classes()) {
+				transfer.buffer = m_core->allocate(capacity);
+			}
+			else {
+				transfer.buffer = m_core->get(size_class);
+				transfer.pool = m_core.get();
+				transfer.size_class = size_class;
+			}
+			if (transfer.buffer) transfer.capacity = capacity;
+			else transfer.pool = nullptr;
+			return transfer;
+		}
+
+		// Allocates count buffers for a capacity up front, so even the first acquire() calls are hits.
+		void prefill(const size_t capacity, const size_t count) {
+			const unsigned size_class = m_core->class_of(capacity);
+			if (size_class < m_core->num_classes()) m_core->prefill(size_class, count);
+		}
+
+		transfer_pool_stats get_stats() const { return m_core->get_stats(); }
+
+	private:
+		std::shared_ptr<detail::transfer_pool_core> m_core;
+	};
+
+	inline void pooled_transfer::release() {
+		if (pool && buffer) {
+			pool->put(size_class, buffer);
+			buffer = nullptr;
+		}
+		pool = nullptr;
+	}
+}
+#endif
@@ -0,0 +1,406 @@
+#ifdef __linux__
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "async_file.h"
+
+namespace core2::io {
+	namespace {
+		// We talk to io_uring through its system calls directly, so there is no dependency on liburing.
+		int io_uring_setup(const unsigned entries, io_uring_params* params) {
+			return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+		}
+		int io_uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags) {
+			return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+		}
+		int io_uring_register(const int fd, const unsigned opcode, const void* arg, const unsigned nr_args) {
+			return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+		}
+	}
+
+	struct async_file::impl {
+		struct request {
+			transfer* buf = nullptr;
+			cb_on_complete on_complete;
+			int file = -1;
+			int fd = -1;  // Taken when the request is queued, so the fallback workers do not read fds (which open() / close() change).
+			u64 offset = 0;
+			bool is_read = false;
+		};
+
+		impl(const options& options);
+		~impl();
+		bool setup_ring();
+		void teardown_ring();
+		void start_fallback();
+		void stop_fallback();
+		bool queue(const int file, transfer& buf, const u64 offset, cb_on_complete&& on_complete, const bool is_read);
+		int submit();
+		unsigned unsubmitted() const;
+		int reap(const unsigned min_complete);
+		void complete(const u32 slot, const i64 result);
+
+		options m_options;
+		std::vector<request> requests;
+		std::vector<u32> free_slots;
+		std::vector<int> fds;
+
+		// io_uring state.
+		bool uring = false;
+		bool fixed_files = false;
+		int ring_fd = -1;
+		void* sq_ring_ptr = MAP_FAILED;
+		void* cq_ring_ptr = MAP_FAILED;
+		size_t sq_ring_size = 0;
+		size_t cq_ring_size = 0;
+		size_t sqes_size = 0;
+		unsigned* sq_head = nullptr;
+		unsigned* sq_tail = nullptr;
+		unsigned* sq_mask = nullptr;
+		unsigned* sq_array = nullptr;
+		io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+		unsigned* cq_head = nullptr;
+		unsigned* cq_tail = nullptr;
+		unsigned* cq_mask = nullptr;
+		io_uring_cqe* cqes = nullptr;
+		unsigned sqe_tail = 0;
+		std::unordered_map<const unsigned char*, u16> registered_buffers;
+
+		// Fallback thread pool state.
+		std::vector<std::thread> workers;
+		std::mutex mtx;
+		std::condition_variable cv_work, cv_done;
+		std::deque<u32> queued, work;
+		std::vector<std::pair<u32, i64>> completed;
+		bool stopping = false;
+	};
+
+	async_file::impl::impl(const options& options) : m_options(options) {
+		if (m_options.queue_depth == 0) m_options.queue_depth = 1;
+		requests.resize(m_options.queue_depth);
+		free_slots.reserve(m_options.queue_depth);
+		for (u32 slot = m_options.queue_depth; slot > 0; slot--) free_slots.push_back(slot - 1);
+		completed.reserve(m_options.queue_depth);
+		if (!m_options.use_io_uring || !setup_ring()) {
+			teardown_ring();
+			start_fallback();
+		}
+	}
+
+	async_file::impl::~impl() {
+		if (uring) teardown_ring();
+		else stop_fallback();
+		for (const auto fd : fds) {
+			if (fd >= 0) ::close(fd);
+		}
+	}
+
+	bool async_file::impl::setup_ring() {
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		ring_fd = io_uring_setup(m_options.queue_depth, &params);
+		if (ring_fd < 0) return false;
+
+		// Map the submission and completion rings (a single mapping on kernels which support it) and the submission entries.
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+		sq_ring_ptr = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ring_ptr == MAP_FAILED) return false;
+		cq_ring_ptr = single_mmap ? sq_ring_ptr : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ring_ptr == MAP_FAILED) return false;
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+		if (sqes == MAP_FAILED) return false;
+
+		auto* sq = static_cast<unsigned char*>(sq_ring_ptr);
+		auto* cq = static_cast<unsigned char*>(cq_ring_ptr);
+		sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		sqe_tail = *sq_tail;
+
+		// Register a sparse file table, files are plugged into it as they are opened.
+		// Without it (older kernels) requests simply use the plain file descriptors.
+		fds.assign(m_options.max_files, -1);
+		fixed_files = io_uring_register(ring_fd, IORING_REGISTER_FILES, fds.data(), m_options.max_files) == 0;
+		uring = true;
+		return true;
+	}
+
+	void async_file::impl::teardown_ring() {
+		if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+		if (cq_ring_ptr != MAP_FAILED && cq_ring_ptr != sq_ring_ptr) munmap(cq_ring_ptr, cq_ring_size);
+		if (sq_ring_ptr != MAP_FAILED) munmap(sq_ring_ptr, sq_ring_size);
+		sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+		cq_ring_ptr = sq_ring_ptr = MAP_FAILED;
+		if (ring_fd >= 0) ::close(ring_fd);
+		ring_fd = -1;
+		uring = false;
+		fixed_files = false;
+	}
+
+	void async_file::impl::start_fallback() {
+		fds.assign(m_options.max_files, -1);
+		const unsigned num_threads = m_options.num_fallback_threads ? m_options.num_fallback_threads : 1;
+		for (unsigned ii = 0; ii < num_threads; ii++) {
+			workers.emplace_back([this] {
+				std::unique_lock<std::mutex> lck(mtx);
+				while (true) {
+					cv_work.wait(lck, [this] { return stopping || !work.empty(); });
+					if (work.empty()) break;
+					const u32 slot = work.front();
+					work.pop_front();
+					lck.unlock();
+					auto& req = requests[slot];
+					const int fd = req.fd;
+					ssize_t rv = req.is_read ? pread(fd, req.buf->buffer, req.buf->capacity, req.offset) : pwrite(fd, req.buf->buffer, req.buf->used, req.offset);
+					if (rv < 0) rv = -errno;
+					lck.lock();
+					completed.push_back({slot, rv});
+					cv_done.notify_all();
+				}
+			});
+		}
+	}
+
+	void async_file::impl::stop_fallback() {
+		{
+			std::lock_guard<std::mutex> lck(mtx);
+			stopping = true;
+		}
+		cv_work.notify_all();
+		for (auto& worker : workers) {
+			if (worker.joinable()) worker.join();
+		}
+		workers.clear();
+	}
+
+	bool async_file::impl::queue(const int file, transfer& buf, const u64 offset, cb_on_complete&& on_complete, const bool is_read) {
+		if (file < 0 || file >= static_cast<int>(fds.size()) || fds[file] < 0) return false;
+		if (!buf.buffer || free_slots.empty()) return false;
+		const u32 slot = free_slots.back();
+		free_slots.pop_back();
+		requests[slot] = request{&buf, std::move(on_complete), file, fds[file], offset, is_read};
+		if (!uring) {
+			queued.push_back(slot);
+			return true;
+		}
+
+		// In flight requests never exceed the queue depth, which is the submission ring size, so there is always room.
+		const unsigned index = sqe_tail & *sq_mask;
+		io_uring_sqe& sqe = sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = is_read ? IORING_OP_READ : IORING_OP_WRITE;
+		sqe.fd = fixed_files ? file : fds[file];
+		if (fixed_files) sqe.flags |= IOSQE_FIXED_FILE;
+		sqe.addr = reinterpret_cast<u64>(buf.buffer);
+		sqe.len = static_cast<u32>(is_read ? buf.capacity : static_cast<size_t>(buf.used));
+		sqe.off = offset;
+		sqe.user_data = slot;
+		const auto registered = registered_buffers.find(buf.buffer);
+		if (registered != registered_buffers.end()) {
+			sqe.opcode = is_read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe.buf_index = registered->second;
+		}
+		sq_array[index] = index;
+		sqe_tail++;
+		return true;
+	}
+
+	int async_file::impl::submit() {
+		if (!uring) {
+			if (queued.empty()) return 0;
+			const int count = static_cast<int>(queued.size());
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				work.insert(work.end(), queued.begin(), queued.end());
+			}
+			queued.clear();
+			cv_work.notify_all();
+			return count;
+		}
+		// Counted from the kernel's head rather than from the published tail: entries the kernel did not take
+		// (a short submit, EAGAIN, EBUSY) are still in the ring and are submitted again by the next call.
+		const unsigned to_submit = unsubmitted();
+		if (!to_submit) return 0;
+		__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+		int rv;
+		do {
+			rv = io_uring_enter(ring_fd, to_submit, 0, 0);
+		} while (rv < 0 && errno == EINTR);
+		if (rv >= 0) return rv;
+		const int error = errno;
+		if (error == EAGAIN || error == EBUSY) return -error;
+
+		// Any other error will not go away, the entries are taken back and their requests fail with it.
+		// Without SQPOLL the kernel only reads the ring within io_uring_enter, so the tail can be moved back.
+		const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		std::vector<u32> failed;
+		for (unsigned tail = head; tail != sqe_tail; tail++) failed.push_back(static_cast<u32>(sqes[sq_array[tail & *sq_mask]].user_data));
+		sqe_tail = head;
+		__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+		for (const auto slot : failed) complete(slot, -error);
+		return -error;
+	}
+
+	// Entries queued in the submission ring which the kernel has not taken yet.
+	unsigned async_file::impl::unsubmitted() const {
+		return uring ? sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) : static_cast<unsigned>(queued.size());
+	}
+
+	int async_file::impl::reap(const unsigned min_complete) {
+		submit();
+
+		// Only requests the kernel (or the workers) took can complete, waiting for the others would never return.
+		const unsigned pending = m_options.queue_depth - static_cast<unsigned>(free_slots.size()) - unsubmitted();
+		const unsigned wait_for = std::min(min_complete, pending);
+		int reaped = 0;
+		if (!uring) {
+			std::vector<std::pair<u32, i64>> done;
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				cv_done.wait(lck, [&] { return completed.size() >= wait_for; });
+				done.swap(completed);
+			}
+			for (const auto& [slot, result] : done) {
+				complete(slot, result);
+				reaped++;
+			}
+			return reaped;
+		}
+		if (wait_for && __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head < wait_for) {
+			while (io_uring_enter(ring_fd, 0, wait_for, IORING_ENTER_GETEVENTS) < 0 && errno == EINTR) {}
+		}
+		// The head is read again for every entry: a callback may call reap(), which consumes entries behind our back.
+		while (true) {
+			const unsigned head = *cq_head;
+			if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) break;
+			const io_uring_cqe& cqe = cqes[head & *cq_mask];
+			const u32 slot = static_cast<u32>(cqe.user_data);
+			const i64 result = cqe.res;
+
+			// Release the entry before the callback, which may queue (and reap) more requests.
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+			complete(slot, result);
+			reaped++;
+		}
+		return reaped;
+	}
+
+	void async_file::impl::complete(const u32 slot, const i64 result) {
+		request req = std::move(requests[slot]);
+		free_slots.push_back(slot);
+		if (req.is_read && result >= 0) req.buf->used = result;
+		if (req.on_complete) req.on_complete(*req.buf, result);
+	}
+
+	async_file::async_file() : async_file(options()) {
+	}
+
+	async_file::async_file(const options& options) {
+		m_pimpl = std::make_unique<impl>(options);
+	}
+
+	// The requests in flight are waited for (and their callbacks called) before the ring goes and the files are closed,
+	// the kernel may still be reading or writing their buffers until then.
+	async_file::~async_file() {
+		while (in_flight()) m_pimpl->reap(1);
+	}
+
+	bool async_file::is_io_uring() const {
+		return m_pimpl->uring;
+	}
+
+	int async_file::open(const std::string& path, const int flags, const int mode) {
+		auto& fds = m_pimpl->fds;
+		int file = 0;
+		while (file < static_cast<int>(fds.size()) && fds[file] >= 0) file++;
+		if (file == static_cast<int>(fds.size())) return -1;
+		const int fd = ::open(path.c_str(), flags, mode);
+		if (fd < 0) return -1;
+		if (m_pimpl->fixed_files) {
+			io_uring_files_update update;
+			std::memset(&update, 0, sizeof(update));
+			update.offset = file;
+			update.fds = reinterpret_cast<u64>(&fd);
+			if (io_uring_register(m_pimpl->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+				::close(fd);
+				return -1;
+			}
+		}
+		fds[file] = fd;
+		return file;
+	}
+
+	void async_file::close(const int file) {
+		auto& fds = m_pimpl->fds;
+		if (file < 0 || file >= static_cast<int>(fds.size()) || fds[file] < 0) return;
+		if (m_pimpl->fixed_files) {
+			const int removed = -1;
+			io_uring_files_update update;
+			std::memset(&update, 0, sizeof(update));
+			update.offset = file;
+			update.fds = reinterpret_cast<u64>(&removed);
+			io_uring_register(m_pimpl->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+		}
+		::close(fds[file]);
+		fds[file] = -1;
+	}
+
+	bool async_file::register_buffers(const std::vector<transfer*>& buffers) {
+		if (!m_pimpl->uring) return false;
+		unregister_buffers();
+		std::vector<iovec> iovecs;
+		iovecs.reserve(buffers.size());
+		for (const auto* buf : buffers) iovecs.push_back({buf->buffer, buf->capacity});
+		if (io_uring_register(m_pimpl->ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), static_cast<unsigned>(iovecs.size())) != 0) return false;
+		for (size_t ii = 0; ii < buffers.size(); ii++) m_pimpl->registered_buffers[buffers[ii]->buffer] = static_cast<u16>(ii);
+		return true;
+	}
+
+	void async_file::unregister_buffers() {
+		if (!m_pimpl->uring || m_pimpl->registered_buffers.empty()) return;
+		io_uring_register(m_pimpl->ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+		m_pimpl->registered_buffers.clear();
+	}
+
+	bool async_file::read(const int file, transfer& buf, const u64 offset, cb_on_complete on_complete) {
+		return m_pimpl->queue(file, buf, offset, std::move(on_complete), true);
+	}
+
+	bool async_file::write(const int file, transfer& buf, const u64 offset, cb_on_complete on_complete) {
+		return m_pimpl->queue(file, buf, offset, std::move(on_complete), false);
+	}
+
+	int async_file::submit() {
+		return m_pimpl->submit();
+	}
+
+	int async_file::reap(const unsigned min_complete) {
+		return m_pimpl->reap(min_complete);
+	}
+
+	size_t async_file::in_flight() const {
+		return m_pimpl->m_options.queue_depth - m_pimpl->free_slots.size();
+	}
+}
+#endif
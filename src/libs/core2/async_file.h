@@ -0,0 +1,83 @@
+#ifndef _ASYNC_FILE_H___
+#define _ASYNC_FILE_H___
+
+#ifdef __linux__
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include "core0/types.h"
+#include "core1/aligned_transfer.h"
+
+namespace core2::io {
+	// Asynchronous file I/O of aligned_transfer buffers (which is what O_DIRECT requires), based on io_uring.
+	// Where io_uring is not available (old kernel, seccomp etc.) requests are served by a pread/pwrite thread pool.
+	// Requests are queued by read()/write(), sent to the kernel in one batch by submit() and their callbacks are
+	// called by reap() on the calling thread. The class itself is not thread safe, use one instance per thread.
+	// Example use:
+	// core2::io::async_file f;
+	// auto file = f.open("/data/capture.bin", O_WRONLY | O_CREAT | O_DIRECT);
+	// f.write(file, buf, offset, [](auto& buf, i64 result){ ... });
+	// f.submit();
+	// f.reap(1);
+	class async_file {
+	public:
+		using transfer = core1::memory::aligned_transfer<false>;
+
+		// Result is the number of bytes transferred or a negative errno.
+		using cb_on_complete = std::function<void(transfer& buf, const i64 result)>;
+
+		struct options {
+			unsigned queue_depth = 128;
+			unsigned max_files = 64;
+			bool use_io_uring = true;
+			unsigned num_fallback_threads = 2;
+		};
+
+		async_file();
+		async_file(const options& options);
+		// Submits what is still queued and waits for all requests in flight, their callbacks are called before it returns.
+		~async_file();
+
+		// Disable copy constructors.
+		async_file(const async_file&) = delete;
+		async_file& operator=(const async_file&) = delete;
+
+		// True if requests are served by io_uring rather than by the fallback thread pool.
+		bool is_io_uring() const;
+
+		// Opens a file and registers it with the ring, returns a file index or -1.
+		// Flags are as in open(2), e.g. O_WRONLY | O_CREAT | O_DIRECT.
+		int open(const std::string& path, const int flags, const int mode = 0644);
+		void close(const int file);
+
+		// Registers buffers with the kernel so it does not have to pin and map them on every request (io_uring only).
+		// The buffers must outlive the registration, registering again replaces the previous set.
+		bool register_buffers(const std::vector<transfer*>& buffers);
+		void unregister_buffers();
+
+		// Queues a read of up to buf.capacity bytes (buf.used is set on completion) or a write of buf.used bytes.
+		// The buffer must stay alive until its callback is called, returns false if the queue is full or the file is invalid.
+		bool read(const int file, transfer& buf, const u64 offset, cb_on_complete on_complete);
+		bool write(const int file, transfer& buf, const u64 offset, cb_on_complete on_complete);
+
+		// Submits all queued requests with a single system call, returns the number of requests submitted or a negative errno.
+		// Requests the kernel did not take (EAGAIN, EBUSY or a short submit) are submitted again by the next call,
+		// on any other error they complete with it.
+		int submit();
+
+		// Submits queued requests, then reaps completions and calls their callbacks, waiting for at least min_complete of them.
+		// Callbacks may queue new requests and call reap() themselves. Returns the number of completions reaped.
+		int reap(const unsigned min_complete = 0);
+
+		// Number of requests which were queued and not reaped yet.
+		size_t in_flight() const;
+
+	private:
+		struct impl;
+		std::unique_ptr<impl> m_pimpl;
+	};
+}
+
+#endif
+#endif
@@ -0,0 +1,356 @@
+#ifndef _FRAMING_H
+#define _FRAMING_H
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <string.h>
+#include "core0/types.h"
+#include "core1/shared_buffer.h"
+#include "serialport.h"
+
+// Frame reassembly over the arbitrary chunks a serial port delivers.
+// Frames are handed out as buffer_slice views of the received buffers, only a frame which spans two chunks
+// is copied (once) into a buffer of its own. COBS and SLIP frames are decoded in place, in the received buffer.
+// Empty frames are skipped. A decoder is not thread safe, feed it from one thread at a time
+// (the port thread, or a single threaded executor if serialport::options::post is used).
+// Example use:
+// framing::cobs_decoder decoder;
+// decoder.set_on_frame([](const core1::memory::buffer_slice& frame){ ... });   // the frame can be kept or queued
+// decoder.attach(port);
+namespace framing {
+	using cb_on_frame = std::function<void(const core1::memory::buffer_slice& frame)>;
+	// Returns false to drop a frame (e.g. a CRC mismatch), it sees the payload including the trailer.
+	using validator = std::function<bool(const u8* data, const size_t len)>;
+
+	struct options {
+		options() {}
+		size_t max_frame = 4096;    // Longer frames are dropped (and counted as errors).
+		size_t trailer_size = 0;    // Bytes stripped from the end of the payload after validation (e.g. a 2 byte CRC).
+		validator validate = nullptr;
+	};
+
+	struct stats {
+		u64 frames = 0;
+		u64 errors = 0;             // Bad encoding, too long or failed validation.
+	};
+
+	class decoder {
+	public:
+		explicit decoder(const options& options) : m_options(options) {}
+		virtual ~decoder() {}
+
+		void set_on_frame(const cb_on_frame& on_frame) { m_on_frame = on_frame; }
+		const stats& get_stats() const { return m_stats; }
+
+		// Feeds the decoder from a port, a receive error drops the frame in progress.
+		void attach(serialport& port) {
+			port.set_cb_on_recv_buffer([this](core1::memory::shared_buffer data, const std::error_code& e) {
+				if (e) this->reset();
+				else this->feed(data);
+			});
+		}
+
+		// Drops a partially received frame.
+		void reset() {
+			m_partial = {};
+			m_partial_len = 0;
+			m_in_frame = false;
+			m_discard = false;
+		}
+
+		// Decodes a chunk, frames are delivered from within this call.
+		void feed(const core1::memory::shared_buffer& chunk) {
+			u8* data = chunk.data();
+			const size_t len = chunk.size();
+			size_t pos = 0;
+			if (m_in_frame) {
+				pos = this->continue_frame(data, len);
+				if (m_in_frame) return;
+			}
+			// Frames which are entirely within the chunk are decoded where they are.
+			while (pos < len) {
+				size_t size;
+				if (!this->frame_size(data + pos, len - pos, size)) break;
+				if (size > m_options.max_frame) {
+					this->start_discard(size);
+					pos += this->continue_frame(data + pos, len - pos);
+					if (m_in_frame) return;
+					continue;
+				}
+				if (size > len - pos) break;
+				this->emit(chunk, pos, size);
+				pos += size;
+			}
+			if (pos < len) {
+				// The rest starts a frame which ends in a later chunk.
+				m_in_frame = true;
+				m_partial_len = 0;
+				m_partial_size = 0;
+				m_discard = false;
+				this->continue_frame(data + pos, len - pos);
+			}
+		}
+
+	protected:
+		static constexpr size_t npos = static_cast<size_t>(-1);
+
+		// Finds the end of the frame which starts at data: returns true with its total size (which may be beyond len)
+		// if it is known, false if more bytes are needed.
+		virtual bool frame_size(const u8* data, const size_t len, size_t& size) = 0;
+		// Same for a frame whose first partial_len bytes arrived earlier (delimited frames only need to look at data).
+		virtual bool frame_size_continued(const u8* partial, const size_t partial_len, const u8* data, const size_t len, size_t& size) = 0;
+		// Turns a complete frame into its payload (in place), returns false if the frame is invalid.
+		virtual bool decode(u8* frame, const size_t size, size_t& offset, size_t& len) = 0;
+
+		// Finds a delimiter byte with memchr (which glibc vectorizes), returns the size up to and including it.
+		static bool find_delimiter(const u8* data, const size_t len, const u8 delimiter, size_t& size) {
+			const auto* end = static_cast<const u8*>(memchr(data, delimiter, len));
+			if (!end) return false;
+			size = static_cast<size_t>(end - data) + 1;
+			return true;
+		}
+
+		options m_options;
+
+	private:
+		void start_discard(const size_t size) {
+			m_in_frame = true;
+			m_discard = true;
+			m_partial_len = 0;
+			m_partial_size = size;
+			m_partial = {};
+			m_stats.errors++;
+		}
+
+		// Adds the bytes of a frame which started in an earlier chunk, returns how many bytes of data it took.
+		size_t continue_frame(const u8* data, const size_t len) {
+			size_t size = m_partial_size;
+			if (!size && !this->frame_size_continued(m_partial.data(), m_partial_len, data, len, size)) size = npos;
+			if (size != npos && size > m_options.max_frame && !m_discard) {
+				m_discard = true;
+				m_stats.errors++;
+			}
+			if (size != npos) m_partial_size = size;
+			const size_t take = size == npos ? len : std::min(len, size - m_partial_len);
+			if (!m_discard) {
+				if (m_partial_len + take > m_options.max_frame) {
+					// Delimited frame grew too long, skip to its end.
+					m_discard = true;
+					m_stats.errors++;
+				}
+				else {
+					if (!m_partial) m_partial = core1::memory::shared_buffer::allocate(m_options.max_frame);
+					memcpy(m_partial.data() + m_partial_len, data, take);
+				}
+			}
+			m_partial_len += take;
+			if (size != npos && m_partial_len == size) {
+				if (!m_discard) this->emit(m_partial, 0, size);
+				m_partial = {};
+				m_in_frame = false;
+				m_discard = false;
+				m_partial_len = 0;
+				m_partial_size = 0;
+			}
+			return take;
+		}
+
+		void emit(const core1::memory::shared_buffer& buffer, const size_t pos, const size_t size) {
+			size_t offset, len;
+			if (!this->decode(buffer.data() + pos, size, offset, len)) {
+				m_stats.errors++;
+				return;
+			}
+			if (m_options.validate && !m_options.validate(buffer.data() + pos + offset, len)) {
+				m_stats.errors++;
+				return;
+			}
+			len -= std::min(len, m_options.trailer_size);
+			if (!len) return;
+			m_stats.frames++;
+			if (m_on_frame) m_on_frame(buffer.slice(pos + offset, len));
+		}
+
+		cb_on_frame m_on_frame;
+		stats m_stats;
+		core1::memory::shared_buffer m_partial;  // Frame which spans chunks.
+		size_t m_partial_len = 0;
+		size_t m_partial_size = 0;               // Its total size once known, 0 before.
+		bool m_in_frame = false;
+		bool m_discard = false;
+	};
+
+	// Frames terminated by a delimiter byte (e.g. '\n'), the delimiter is not part of the frame.
+	class delimiter_decoder : public decoder {
+	public:
+		explicit delimiter_decoder(const u8 delimiter = '\n', const options& options = {}) : decoder(options), m_delimiter(delimiter) {}
+
+	protected:
+		bool frame_size(const u8* data, const size_t len, size_t& size) override {
+			return find_delimiter(data, len, m_delimiter, size);
+		}
+		bool frame_size_continued(const u8*, const size_t partial_len, const u8* data, const size_t len, size_t& size) override {
+			if (!find_delimiter(data, len, m_delimiter, size)) return false;
+			size += partial_len;
+			return true;
+		}
+		bool decode(u8*, const size_t size, size_t& offset, size_t& len) override {
+			offset = 0;
+			len = size - 1;
+			return true;
+		}
+
+	private:
+		const u8 m_delimiter;
+	};
+
+	// Frames with a length header (1, 2 or 4 bytes) or of a fixed size (header_size 0), the header is not part of the frame.
+	class length_prefix_decoder : public decoder {
+	public:
+		struct format {
+			format() {}
+			unsigned header_size = 2;
+			bool big_endian = true;
+			i64 length_adjust = 0;      // Added to the header value to get the payload length (e.g. -2 if it counts the header).
+			size_t fixed_size = 0;      // Payload size when header_size is 0.
+		};
+
+		// header_size is clamped to 4 and a fixed_size of 0 to 1, so every frame consumes at least a byte.
+		explicit length_prefix_decoder(const format& format = {}, const options& options = {}) : decoder(options), m_format(validated(format)) {}
+
+	protected:
+		bool frame_size(const u8* data, const size_t len, size_t& size) override {
+			if (len < m_format.header_size) return false;
+			size = m_format.header_size + this->payload_size(data);
+			return true;
+		}
+		bool frame_size_continued(const u8* partial, const size_t partial_len, const u8* data, const size_t len, size_t& size) override {
+			u8 header[4];
+			if (partial_len + len < m_format.header_size) return false;
+			const size_t from_partial = std::min<size_t>(partial_len, m_format.header_size);
+			if (from_partial) memcpy(header, partial, from_partial);
+			memcpy(header + from_partial, data, m_format.header_size - from_partial);
+			size = m_format.header_size + this->payload_size(header);
+			return true;
+		}
+		bool decode(u8*, const size_t size, size_t& offset, size_t& len) override {
+			offset = m_format.header_size;
+			len = size - m_format.header_size;
+			return true;
+		}
+
+	private:
+		static format validated(format format) {
+			format.header_size = std::min(format.header_size, 4u);
+			if (!format.header_size) format.fixed_size = std::max<size_t>(format.fixed_size, 1);
+			return format;
+		}
+
+		size_t payload_size(const u8* header) const {
+			if (!m_format.header_size) return m_format.fixed_size;
+			u64 value = 0;
+			for (unsigned ii = 0; ii < m_format.header_size; ii++) {
+				const unsigned shift = 8 * (m_format.big_endian ? m_format.header_size - 1 - ii : ii);
+				value |= static_cast<u64>(header[ii]) << shift;
+			}
+			const i64 len = static_cast<i64>(value) + m_format.length_adjust;
+			return len > 0 ? static_cast<size_t>(len) : 0;
+		}
+
+		const format m_format;
+	};
+
+	// Consistent overhead byte stuffing, frames are terminated by a 0 byte.
+	class cobs_decoder : public decoder {
+	public:
+		explicit cobs_decoder(const options& options = {}) : decoder(options) {}
+
+	protected:
+		bool frame_size(const u8* data, const size_t len, size_t& size) override {
+			return find_delimiter(data, len, 0, size);
+		}
+		bool frame_size_continued(const u8*, const size_t partial_len, const u8* data, const size_t len, size_t& size) override {
+			if (!find_delimiter(data, len, 0, size)) return false;
+			size += partial_len;
+			return true;
+		}
+		// The decoded bytes are never ahead of the encoded ones, so the frame is decoded over itself.
+		bool decode(u8* frame, const size_t size, size_t& offset, size_t& len) override {
+			const size_t encoded = size - 1;
+			size_t read = 0, write = 0;
+			while (read < encoded) {
+				const u8 code = frame[read++];
+				if (!code || read + code - 1 > encoded) return false;
+				for (unsigned ii = 1; ii < code; ii++) frame[write++] = frame[read++];
+				if (code != 0xFF && read < encoded) frame[write++] = 0;
+			}
+			offset = 0;
+			len = write;
+			return true;
+		}
+	};
+
+	// Serial line IP framing (RFC 1055), frames are terminated by END, a leading END is skipped as an empty frame.
+	class slip_decoder : public decoder {
+	public:
+		static constexpr u8 end = 0xC0;
+		static constexpr u8 esc = 0xDB;
+		static constexpr u8 esc_end = 0xDC;
+		static constexpr u8 esc_esc = 0xDD;
+
+		explicit slip_decoder(const options& options = {}) : decoder(options) {}
+
+	protected:
+		bool frame_size(const u8* data, const size_t len, size_t& size) override {
+			return find_delimiter(data, len, end, size);
+		}
+		bool frame_size_continued(const u8*, const size_t partial_len, const u8* data, const size_t len, size_t& size) override {
+			if (!find_delimiter(data, len, end, size)) return false;
+			size += partial_len;
+			return true;
+		}
+		bool decode(u8* frame, const size_t size, size_t& offset, size_t& len) override {
+			const size_t encoded = size - 1;
+			size_t write = 0;
+			for (size_t read = 0; read < encoded; read++) {
+				if (frame[read] != esc) {
+					frame[write++] = frame[read];
+					continue;
+				}
+				if (++read == encoded) return false;
+				if (frame[read] == esc_end) frame[write++] = end;
+				else if (frame[read] == esc_esc) frame[write++] = esc;
+				else return false;
+			}
+			offset = 0;
+			len = write;
+			return true;
+		}
+	};
+
+	// CRC-16/CCITT-FALSE and CRC-32 (IEEE), for validators.
+	inline u16 crc16_ccitt(const u8* data, const size_t len, u16 crc = 0xFFFF) {
+		for (size_t ii = 0; ii < len; ii++) {
+			crc ^= static_cast<u16>(data[ii]) << 8;
+			for (int bit = 0; bit < 8; bit++) crc = crc & 0x8000 ? static_cast<u16>((crc << 1) ^ 0x1021) : static_cast<u16>(crc << 1);
+		}
+		return crc;
+	}
+	inline u32 crc32(const u8* data, const size_t len, u32 crc = 0) {
+		static const auto table = [] {
+			std::array<u32, 256> t{};
+			for (u32 ii = 0; ii < 256; ii++) {
+				u32 c = ii;
+				for (int bit = 0; bit < 8; bit++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				t[ii] = c;
+			}
+			return t;
+		}();
+		crc = ~crc;
+		for (size_t ii = 0; ii < len; ii++) crc = table[(crc ^ data[ii]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+}
+
+#endif
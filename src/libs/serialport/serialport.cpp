@@ -6,48 +6,147 @@
 #ifdef __linux__
 #include <sys/file.h>
 #endif
-#include <mutex>
 #include <thread>
 #include <memory>
 #include <atomic>
-#include <deque>
+#include <vector>
+#include <algorithm>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
 #include "asio/include/asio.hpp"
 #include "asio/include/asio/serial_port.hpp"
+#include "core0/mpsc_queue.h"
+#include "core0/thread_utils.h"
+#include "core1/transfer_pool.h"
 #include "serialport.h"
 
 struct serialport::impl {
-	impl();
+	using serial_port_ptr = std::shared_ptr<asio::serial_port>;
+	explicit impl(asio::io_context* shared_context);
 	~impl();
 	void async_read_some();
 	void configure();
 	void stop();
-	void on_receive(const std::error_code ec, size_t bytes_transferred);
+	void close_port();
+	void recover();
+	void on_receive(serial_port_ptr read_port, const std::error_code ec, size_t bytes_transferred);
+	void deliver(const std::error_code ec, size_t bytes_transferred);
+	void adapt_read_size(const size_t bytes_transferred);
+	void notify_sent(const cb_on_async_send& on_send, const std::error_code ec, const size_t length);
 	serialport::options m_options;
 	std::string port_name;
-	const int read_buf_size = 256;
 	std::atomic<bool> running{false};
 	asio::io_context io_context;
 	std::thread io_context_thread;
-	using serial_port_ptr = std::shared_ptr<asio::serial_port>;
+	// The port runs on its own io_context and thread, or on the shared one of a serialport_manager.
+	// Either way its handlers run on a strand, one at a time.
+	asio::io_context& context;
+	const bool shared;
+	asio::strand<asio::io_context::executor_type> strand;
+	asio::steady_timer recover_timer;
 	serial_port_ptr port;
-	std::mutex mtx;
-	u8 *read_buf_raw;
+	std::atomic<bool> port_open{false};        // Mirrors port->is_open() for other threads.
+	core1::memory::pooled_transfer read_buf;   // Handed over to the receive call back, a fresh one is used for the next read.
+	size_t read_size = 256;
+	unsigned short_reads = 0;
 	cb_on_recv on_recv;
-	using send_msg = struct{ std::shared_ptr<std::vector<u8>> payload; size_t len; };
-	std::deque<send_msg> send_msgs_vec; // If we ever wanted buffering here, replace the deque with a producer consumer queue (handler which pops the queue is called from the io_context thread, while push_back is from the async_write call thread).
-	std::deque<std::shared_ptr<std::string>> send_msgs_str; // If we ever wanted buffering here, replace the deque with a producer consumer queue (handler which pops the queue is called from the io_context thread, while push_back is from the async_write call thread).
-	std::atomic<bool> async_write_in_progress{false};
-	cb_on_async_send on_async_send;
+	cb_on_recv_buffer on_recv_buffer;
+
+	// Async sending: any thread queues messages, the strand writes them out, several per gathered write.
+	struct send_msg {
+		std::shared_ptr<std::vector<u8>> vec;
+		std::shared_ptr<std::string> str;
+		const u8* data = nullptr;
+		size_t len = 0;
+		cb_on_async_send on_send;
+	};
+	bool queue_send(send_msg msg);
+	void start_write();
+	void on_write(const std::error_code ec, size_t bytes_transferred);
+	void abort_sends();
+	core0::mpsc_queue<send_msg> send_queue;
+	std::vector<send_msg> send_batch;                 // Messages of the write in flight.
+	std::vector<asio::const_buffer> send_buffers;
+	std::atomic<size_t> send_queued_msgs{0};          // Queued and in flight, for backpressure.
+	std::atomic<size_t> send_queued_bytes{0};
+	std::atomic<bool> write_in_progress{false};
+
+	// Handlers queued or in flight: stop() waits for them on a shared io_context, where it cannot join a thread.
+	template <typename HANDLER>
+	auto track(HANDLER handler) {
+		pending.fetch_add(1, std::memory_order_relaxed);
+		return asio::bind_executor(strand, [this, handler = std::move(handler)](auto&&... args) mutable {
+			handler(std::forward<decltype(args)>(args)...);
+			op_done();
+		});
+	}
+	void post(std::function<void()> fn) { asio::post(strand, track(std::move(fn))); }
+	void op_done();
+	void wait_idle();
+	std::atomic<size_t> pending{0};
+	std::mutex idle_mutex;
+	std::condition_variable idle_cv;
+
+	struct counters {
+		std::atomic<u64> rx_bytes{0};
+		std::atomic<u64> rx_reads{0};
+		std::atomic<u64> tx_bytes{0};
+		std::atomic<u64> tx_messages{0};
+		std::atomic<u64> tx_rejected{0};
+		std::atomic<u64> errors{0};
+		std::atomic<u64> recoveries{0};
+	} counters;
+	static void count(std::atomic<u64>& counter, const u64 value = 1) { counter.fetch_add(value, std::memory_order_relaxed); }
+};
+
+struct serialport_manager::impl {
+	asio::io_context io_context;
+	asio::executor_work_guard<asio::io_context::executor_type> work{asio::make_work_guard(io_context)};
+	std::vector<std::thread> threads;
+	struct entry {
+		std::string port_name;
+		serialport::options options;
+		std::shared_ptr<serialport> port;
+	};
+	// Only guards the list, ports are started and stopped on copies of it (so call backs can use the manager meanwhile).
+	mutable std::mutex mutex;
+	std::vector<entry> ports;
+	std::vector<entry> snapshot() const {
+		std::lock_guard<std::mutex> lck(mutex);
+		return ports;
+	}
 };
 
-serialport::impl::impl() {
-	read_buf_raw = new u8[read_buf_size];
+// The io_context whose pool the calling thread belongs to (nullptr outside of a manager thread).
+static const asio::io_context*& pool_of_this_thread() {
+	static thread_local const asio::io_context* pool = nullptr;
+	return pool;
+}
+
+// Receive buffers of all ports, it is never destroyed since buffers handed to consumers may outlive their port.
+static core1::memory::transfer_pool& recv_pool() {
+	static auto* pool = [] {
+		core1::memory::transfer_pool::options options;
+		options.min_size = 256;
+		options.max_size = 1 << 20;
+		options.alignment = 0;
+		options.max_cached_bytes = 64 << 20;
+		return new core1::memory::transfer_pool(options);
+	}();
+	return *pool;
+}
+
+serialport::impl::impl(asio::io_context* shared_context) :
+	context(shared_context ? *shared_context : io_context),
+	shared(shared_context != nullptr),
+	strand(asio::make_strand(context)),
+	recover_timer(strand) {
 	on_recv = nullptr;
+	on_recv_buffer = nullptr;
 }
 
 serialport::impl::~impl() {
-	delete[] read_buf_raw;
 }
 
 void serialport::impl::async_read_some() {
@@ -55,13 +154,20 @@ void serialport::impl::async_read_some() {
 		return;
 	}
 
+	if (!read_buf.buffer || read_buf.capacity != read_size) {
+		read_buf = recv_pool().acquire(read_size);
+		if (!read_buf.buffer) {
+			return;
+		}
+	}
 	port->async_read_some(
-		asio::buffer(read_buf_raw, read_buf_size),
-		std::bind(
+		asio::buffer(read_buf.buffer, read_buf.capacity),
+		track(std::bind(
 			&serialport::impl::on_receive,
 			this,
+			port,
 			std::placeholders::_1,
-			std::placeholders::_2));
+			std::placeholders::_2)));
 }
 
 void serialport::impl::configure() {
@@ -88,56 +194,271 @@ void serialport::impl::configure() {
 	}
 }
 
+// The port is only touched by handlers on its strand, except before the port starts and after it stopped.
+// So the receive path needs no lock: stop() clears the running flag, has the strand close the port and waits for the
+// handlers to run out (by joining the port thread, or on a shared io_context by waiting for the tracked handlers).
 void serialport::impl::stop() {
 	running = false;
-	std::lock_guard<std::mutex> lock(mtx);
-	if (port) {
-		if (port->is_open()) {
-			port->cancel();
+	if (strand.running_in_this_thread()) {
+		// Called from a call back, the thread is joined (or the handlers waited for) by the next start() or by the destructor.
+		close_port();
+		if (!shared) io_context.stop();
+		abort_sends();
+		return;
+	}
+	// The send queue has a single consumer, the strand, so the queued messages are failed there.
+	if (shared) {
+		post([this] { close_port(); abort_sends(); });
+		wait_idle();
+		return;
+	}
+	if (io_context_thread.joinable()) {
+		post([this] { close_port(); abort_sends(); });
+		io_context_thread.join();
+	}
+	// If the thread had already run out of work, the close (and any other handler left) runs here instead.
+	// No other thread runs the io_context now, so this thread stands in for the strand.
+	io_context.restart();
+	io_context.poll();
+	close_port();
+	io_context.restart();
+	abort_sends();
+}
+
+void serialport::impl::close_port() {
+	recover_timer.cancel();
+	port_open = false;
+	if (port && port->is_open()) {
+		std::error_code ec;
+		port->cancel(ec);
 #ifdef __linux__
-			flock(port->native_handle(), LOCK_UN | LOCK_NB);
+		flock(port->native_handle(), LOCK_UN | LOCK_NB);
 #endif
-			port->close();
-			port.reset();
+		port->close(ec);
+	}
+}
+
+void serialport::impl::on_receive(serial_port_ptr read_port, const std::error_code ec, size_t bytes_transferred) {
+	// Stopping (stop() closes the port next), the read was cancelled by the close, or it belongs to a port since replaced.
+	if (!running || read_port != port || port.get() == NULL || !port->is_open()) {
+		return;
+	}
+	count(counters.rx_reads);
+	count(counters.rx_bytes, bytes_transferred);
+	adapt_read_size(bytes_transferred);
+	deliver(ec, bytes_transferred);
+	if (ec.value() != 0) {
+		count(counters.errors);
+		close_port();
+		if (m_options.auto_recover) {
+			recover();
 		}
+		return;
 	}
-	io_context.stop();
-	io_context.restart();
+	async_read_some();
 }
 
-void serialport::impl::on_receive(const std::error_code ec, size_t bytes_transferred) {
-	std::lock_guard<std::mutex> lock(mtx);
-	if (port.get() == NULL || !port->is_open()) {
+// Reopens the port, retrying once a second on a timer (so a port which is gone does not hold a thread).
+void serialport::impl::recover() {
+	if (!running) {
 		return;
 	}
-	if (on_recv) {
-		on_recv(read_buf_raw, bytes_transferred, ec);
+	std::error_code e;
+	port->open(port_name.c_str(), e);
+	if (!e) {
+		configure();
+		port_open = true;
+		count(counters.recoveries);
+		if (m_options.on_recoverd) {
+			m_options.on_recoverd();
+		}
+		async_read_some();
+		return;
 	}
-	if (ec.value() != 0) {
-		port->cancel();
-		port->close();
-		if (!m_options.auto_recover) {
-			return;
+	using namespace std::chrono_literals;
+	recover_timer.expires_after(1s);
+	recover_timer.async_wait(track([this](const std::error_code ec) {
+		if (!ec) {
+			recover();
 		}
-		while (running) {
-			std::error_code e;
-			auto ret_open = port->open(port_name.c_str(), e);
-			if (!e) {
-				configure();
-				if (m_options.on_recoverd) {
-					m_options.on_recoverd();
-				}
-				break;
+	}));
+}
+
+void serialport::impl::op_done() {
+	if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		std::lock_guard<std::mutex> lck(idle_mutex);
+		idle_cv.notify_all();
+	}
+}
+
+// On a thread of the shared pool (e.g. a call back of another port) blocking could starve the handlers waited for,
+// so the thread runs them (and whatever else is queued) itself.
+// A stand alone port whose thread was joined has nothing else running its io_context (e.g. a write which an async_send
+// racing stop() queued late), so its handlers are drained here.
+void serialport::impl::wait_idle() {
+	if (!shared && !io_context_thread.joinable()) {
+		while (pending.load(std::memory_order_acquire) != 0) {
+			io_context.restart();
+			if (!io_context.poll()) {
+				std::this_thread::yield();
 			}
-			using namespace std::chrono_literals;
-			std::this_thread::sleep_for(1s);
 		}
+		io_context.restart();
+		return;
+	}
+	if (shared && pool_of_this_thread() == &context) {
+		while (pending.load(std::memory_order_acquire) != 0) {
+			context.run_one();
+		}
+		return;
+	}
+	std::unique_lock<std::mutex> lck(idle_mutex);
+	idle_cv.wait(lck, [this] { return pending.load(std::memory_order_acquire) == 0; });
+}
+
+void serialport::impl::notify_sent(const cb_on_async_send& on_send, const std::error_code ec, const size_t length) {
+	if (!on_send) {
+		return;
+	}
+	if (m_options.post) {
+		m_options.post([on_send, ec, length] { on_send(ec, length); });
+	}
+	else {
+		on_send(ec, length);
+	}
+}
+
+bool serialport::impl::queue_send(send_msg msg) {
+	// Reserve room first, so concurrent senders cannot overshoot the limits together.
+	const auto queued_msgs = send_queued_msgs.fetch_add(1) + 1;
+	const auto queued_bytes = send_queued_bytes.fetch_add(msg.len) + msg.len;
+	if ((m_options.tx_max_messages && queued_msgs > m_options.tx_max_messages) || (m_options.tx_max_bytes && queued_bytes > m_options.tx_max_bytes && queued_msgs > 1)) {
+		send_queued_msgs.fetch_sub(1);
+		send_queued_bytes.fetch_sub(msg.len);
+		count(counters.tx_rejected);
+		notify_sent(msg.on_send, std::make_error_code(std::errc::no_buffer_space), 0);
+		return false;
+	}
+	send_queue.push(std::move(msg));
+	if (!write_in_progress.exchange(true)) {
+		post([this] { start_write(); });
+	}
+	return true;
+}
+
+// Called on the strand while write_in_progress is set.
+void serialport::impl::start_write() {
+	while (true) {
+		send_msg msg;
+		const size_t max_batch = m_options.tx_max_coalesce ? m_options.tx_max_coalesce : 1;
+		while (send_batch.size() < max_batch && send_queue.try_pop(msg)) {
+			send_buffers.push_back(asio::buffer(msg.data, msg.len));
+			send_batch.push_back(std::move(msg));
+		}
+		if (!send_batch.empty()) {
+			break;
+		}
+		// Nothing to write: clear the flag, then look again for a message queued just before it was cleared
+		// (its sender saw the flag still set and did not schedule a write).
+		write_in_progress = false;
+		if (send_queued_msgs.load() == 0 || write_in_progress.exchange(true)) {
+			return;
+		}
+	}
+	if (!port || !port->is_open()) {
+		on_write(std::make_error_code(std::errc::not_connected), 0);
+		return;
+	}
+	asio::async_write(*port, send_buffers, track(std::bind(&serialport::impl::on_write, this, std::placeholders::_1, std::placeholders::_2)));
+}
+
+void serialport::impl::on_write(const std::error_code ec, size_t bytes_transferred) {
+	// Each message is reported with the part of it which made it out (all of it unless there was an error).
+	count(counters.tx_bytes, bytes_transferred);
+	if (ec) {
+		count(counters.errors);
+	}
+	else {
+		count(counters.tx_messages, send_batch.size());
+	}
+	size_t bytes = 0;
+	for (auto& msg : send_batch) {
+		const auto sent = std::min(msg.len, bytes_transferred);
+		bytes_transferred -= sent;
+		bytes += msg.len;
+		notify_sent(msg.on_send, ec, sent);
+	}
+	send_queued_msgs.fetch_sub(send_batch.size());
+	send_queued_bytes.fetch_sub(bytes);
+	send_batch.clear();
+	send_buffers.clear();
+	start_write();
+}
+
+// Fails the queued messages (after the port was closed).
+void serialport::impl::abort_sends() {
+	send_msg msg;
+	while (send_queue.try_pop(msg)) {
+		send_queued_msgs.fetch_sub(1);
+		send_queued_bytes.fetch_sub(msg.len);
+		notify_sent(msg.on_send, std::make_error_code(std::errc::operation_canceled), 0);
+	}
+}
+
+// Hands the received bytes over: the buffer goes to the consumer and the next read gets a fresh one from the pool.
+void serialport::impl::deliver(const std::error_code ec, size_t bytes_transferred) {
+	if (!on_recv_buffer && !on_recv) {
+		return;
+	}
+	if (!on_recv_buffer && !m_options.post) {
+		on_recv(read_buf.buffer, bytes_transferred, ec);
+		return;
+	}
+	core1::memory::shared_buffer data;
+	if (bytes_transferred) {
+		read_buf.used = static_cast<ssize_t>(bytes_transferred);
+		data = core1::memory::shared_buffer::adopt(std::move(read_buf));
+	}
+	std::function<void()> work;
+	if (on_recv_buffer) {
+		work = [cb = on_recv_buffer, data, ec] { cb(data, ec); };
+	}
+	else {
+		work = [cb = on_recv, data, ec] { cb(data.data(), data.size(), ec); };
+	}
+	if (m_options.post) {
+		m_options.post(std::move(work));
+	}
+	else {
+		work();
+	}
+}
+
+// Reads which fill the buffer double the read size (up to read_size_max), a run of mostly empty reads halves it again.
+void serialport::impl::adapt_read_size(const size_t bytes_transferred) {
+	const size_t min_size = std::max<size_t>(m_options.read_size, 1);
+	const size_t max_size = std::max(m_options.read_size_max, min_size);
+	if (bytes_transferred == read_size && read_size < max_size) {
+		read_size = std::min(read_size * 2, max_size);
+		short_reads = 0;
+	}
+	else if (bytes_transferred < read_size / 4 && read_size > min_size) {
+		if (++short_reads >= 8) {
+			read_size = std::max(read_size / 2, min_size);
+			short_reads = 0;
+		}
+	}
+	else {
+		short_reads = 0;
 	}
-	async_read_some();
 }
 
 serialport::serialport() {
-	m_pimpl = std::make_unique<impl>();
+	m_pimpl = std::make_unique<impl>(nullptr);
+}
+
+serialport::serialport(serialport_manager& manager) {
+	m_pimpl = std::make_unique<impl>(&manager.m_pimpl->io_context);
 }
 
 serialport::~serialport() {
@@ -145,13 +466,14 @@ serialport::~serialport() {
 	if (m_pimpl->io_context_thread.joinable()) {
 		m_pimpl->io_context_thread.join();
 	}
+	m_pimpl->wait_idle();
 }
 
 serialport::operator bool() {
 	if (!m_pimpl->running) {
 		return false;
 	}
-	if (!m_pimpl->port->is_open()) {
+	if (!m_pimpl->port_open) {
 		return false;
 	}
 	return true;
@@ -159,15 +481,34 @@ serialport::operator bool() {
 
 bool serialport::start(const std::string& port_name, const options& options) {
 	std::error_code ec;
-	if (m_pimpl->port) {
-		if (m_pimpl->port->is_open()) {
-			return true;
-		}
+	if (m_pimpl->port_open) {
+		return true;
+	}
+
+	// A port which lost its device and is retrying (auto_recover) is stopped first, which cancels the retry timer.
+	// Otherwise the port would never run out of work to wait for.
+	const bool on_strand = m_pimpl->strand.running_in_this_thread();
+	if (!m_pimpl->shared && on_strand) {
+		// A stand alone port cannot replace its own thread from a call back.
+		return false;
+	}
+	if (m_pimpl->running) {
+		m_pimpl->stop();
+	}
+
+	// A port stopped from one of its call backs leaves its thread to be joined (or its handlers to finish) here.
+	if (m_pimpl->io_context_thread.joinable()) {
+		m_pimpl->io_context_thread.join();
+		m_pimpl->io_context.restart();
+	}
+	if (m_pimpl->shared && !on_strand) {
+		m_pimpl->wait_idle();
 	}
 
 	m_pimpl->m_options = options;
+	m_pimpl->read_size = std::max<size_t>(options.read_size, 1);
 	m_pimpl->port_name = std::string(port_name);
-	m_pimpl->port = impl::serial_port_ptr(new asio::serial_port(m_pimpl->io_context));
+	m_pimpl->port = impl::serial_port_ptr(new asio::serial_port(m_pimpl->context));
 	auto ret_open = m_pimpl->port->open(port_name, ec);
 	if (ec) {
 		return false;
@@ -179,9 +520,15 @@ bool serialport::start(const std::string& port_name, const options& options) {
 	if (ret) return false;
 #endif
 	m_pimpl->configure();
+	m_pimpl->port_open = true;
 
 	// First time is required to bind the handler.
 	m_pimpl->running = true;
+	if (m_pimpl->shared) {
+		// The manager threads are running already, so the first read is started on the strand.
+		m_pimpl->post([impl = m_pimpl.get()] { impl->async_read_some(); });
+		return true;
+	}
 	m_pimpl->async_read_some();
 
 	// Context must be started after the read so the run call will block.
@@ -194,8 +541,21 @@ void serialport::stop() {
 	m_pimpl->stop();
 }
 
+// Once the port runs, the call backs belong to the strand, so they are swapped there.
 void serialport::set_cb_on_recv(const cb_on_recv& on_recv) {
-	m_pimpl->on_recv = on_recv;
+	if (!m_pimpl->running) {
+		m_pimpl->on_recv = on_recv;
+		return;
+	}
+	m_pimpl->post([impl = m_pimpl.get(), on_recv] { impl->on_recv = on_recv; });
+}
+
+void serialport::set_cb_on_recv_buffer(const cb_on_recv_buffer& on_recv) {
+	if (!m_pimpl->running) {
+		m_pimpl->on_recv_buffer = on_recv;
+		return;
+	}
+	m_pimpl->post([impl = m_pimpl.get(), on_recv] { impl->on_recv_buffer = on_recv; });
 }
 
 size_t serialport::send(const std::string& buf) {
@@ -210,7 +570,7 @@ size_t serialport::send(const u8* buf, const size_t& size) {
 	if (!m_pimpl->running) {
 		return -1;
 	}
-	if (!m_pimpl->port->is_open()) {
+	if (!m_pimpl->port_open) {
 		return -1;
 	}
 	if (size == 0) {
@@ -225,59 +585,152 @@ size_t serialport::send(const u8* buf, const size_t& size) {
 }
 
 bool serialport::async_send(std::shared_ptr<std::vector<u8>> buf, const size_t& size, const cb_on_async_send& on_send) {
-	if (!m_pimpl->running) {
+	if (!m_pimpl->running || !m_pimpl->port_open) {
+		if (on_send) on_send(std::error_code(), 0);
 		return false;
 	}
-	if (!m_pimpl->port->is_open() || m_pimpl->async_write_in_progress) {
-		on_send(std::error_code(), 0);
+	serialport::impl::send_msg msg;
+	msg.data = buf->data();
+	msg.len = std::min(size, buf->size());
+	msg.vec = std::move(buf);
+	msg.on_send = on_send;
+	return m_pimpl->queue_send(std::move(msg));
+}
+
+bool serialport::async_send(std::shared_ptr<std::string> buf, const cb_on_async_send& on_send) {
+	if (!m_pimpl->running || !m_pimpl->port_open) {
+		if (on_send) on_send(std::error_code(), 0);
 		return false;
 	}
-	m_pimpl->async_write_in_progress = true;
-	m_pimpl->on_async_send = on_send;
-	m_pimpl->send_msgs_vec.push_back(serialport::impl::send_msg{buf, size});
-	try {
-		asio::async_write(*m_pimpl->port, asio::buffer(buf.get()->data(), size), [&](const std::error_code ec, std::size_t length) {
-			if (!ec) {
-				if (m_pimpl->on_async_send) m_pimpl->on_async_send(ec, length);
-			}
-			else {
-				if (m_pimpl->on_async_send) m_pimpl->on_async_send(ec, length);
-			}
-			m_pimpl->send_msgs_vec.pop_front();
-			m_pimpl->async_write_in_progress = false;
+	serialport::impl::send_msg msg;
+	msg.data = reinterpret_cast<const u8*>(buf->data());
+	msg.len = buf->size();
+	msg.str = std::move(buf);
+	msg.on_send = on_send;
+	return m_pimpl->queue_send(std::move(msg));
+}
+
+serialport::stats serialport::get_stats() const {
+	const auto& counters = m_pimpl->counters;
+	stats stats;
+	stats.rx_bytes = counters.rx_bytes.load(std::memory_order_relaxed);
+	stats.rx_reads = counters.rx_reads.load(std::memory_order_relaxed);
+	stats.tx_bytes = counters.tx_bytes.load(std::memory_order_relaxed);
+	stats.tx_messages = counters.tx_messages.load(std::memory_order_relaxed);
+	stats.tx_rejected = counters.tx_rejected.load(std::memory_order_relaxed);
+	stats.errors = counters.errors.load(std::memory_order_relaxed);
+	stats.recoveries = counters.recoveries.load(std::memory_order_relaxed);
+	return stats;
+}
+
+serialport_manager::serialport_manager(const options& options) {
+	m_pimpl = std::make_unique<impl>();
+	const unsigned num_threads = options.num_threads ? options.num_threads : std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned ii = 0; ii < num_threads; ii++) {
+		m_pimpl->threads.emplace_back([impl = m_pimpl.get(), ii, options] {
+			if (!options.cpus.empty()) core0::this_thread::set_affinity(options.cpus[ii % options.cpus.size()]);
+			if (!options.name.empty()) core0::this_thread::set_name(options.name + std::to_string(ii));
+			pool_of_this_thread() = &impl->io_context;
+			impl->io_context.run();
 		});
-		return true;
 	}
-	catch (const std::exception& e) {
-		return false;
+}
+
+serialport_manager::~serialport_manager() {
+	// The ports wait for their handlers, so they go before the threads.
+	std::vector<impl::entry> ports;
+	{
+		std::lock_guard<std::mutex> lck(m_pimpl->mutex);
+		ports.swap(m_pimpl->ports);
+	}
+	ports.clear();
+	m_pimpl->work.reset();
+	for (auto& thread : m_pimpl->threads) {
+		if (thread.joinable()) {
+			thread.join();
+		}
 	}
 }
 
-bool serialport::async_send(std::shared_ptr<std::string> buf, const cb_on_async_send& on_send) {
-	if (!m_pimpl->running) {
-		return false;
+serialport& serialport_manager::add(const std::string& port_name, const serialport::options& options) {
+	std::lock_guard<std::mutex> lck(m_pimpl->mutex);
+	for (auto& entry : m_pimpl->ports) {
+		if (entry.port_name == port_name) {
+			entry.options = options;
+			return *entry.port;
+		}
 	}
-	if (!m_pimpl->port->is_open() || m_pimpl->async_write_in_progress) {
-		on_send(std::error_code(), 0);
-		return false;
+	m_pimpl->ports.push_back({port_name, options, std::shared_ptr<serialport>(new serialport(*this))});
+	return *m_pimpl->ports.back().port;
+}
+
+bool serialport_manager::remove(const std::string& port_name) {
+	std::shared_ptr<serialport> port;
+	{
+		std::lock_guard<std::mutex> lck(m_pimpl->mutex);
+		auto it = std::find_if(m_pimpl->ports.begin(), m_pimpl->ports.end(), [&](const impl::entry& entry) { return entry.port_name == port_name; });
+		if (it == m_pimpl->ports.end()) {
+			return false;
+		}
+		port = std::move(it->port);
+		m_pimpl->ports.erase(it);
 	}
-	m_pimpl->async_write_in_progress = true;
-	m_pimpl->on_async_send = on_send;
-	m_pimpl->send_msgs_str.push_back(buf);
-	try {
-		asio::async_write(*m_pimpl->port, asio::buffer(buf.get()->data(), buf.get()->size()), [&](const std::error_code ec, std::size_t length) {
-			if (!ec) {
-				if (m_pimpl->on_async_send) m_pimpl->on_async_send(ec, length);
-			}
-			else {
-				if (m_pimpl->on_async_send) m_pimpl->on_async_send(ec, length);
-			}
-			m_pimpl->send_msgs_str.pop_front();
-			m_pimpl->async_write_in_progress = false;
-		});
-		return true;
+	// Stopped outside the lock, it waits for its handlers (destroyed here, or by a start() / stop() which still holds it).
+	port->stop();
+	port.reset();
+	return true;
+}
+
+serialport* serialport_manager::find(const std::string& port_name) {
+	std::lock_guard<std::mutex> lck(m_pimpl->mutex);
+	for (auto& entry : m_pimpl->ports) {
+		if (entry.port_name == port_name) {
+			return entry.port.get();
+		}
 	}
-	catch (const std::exception& e) {
-		return false;
+	return nullptr;
+}
+
+size_t serialport_manager::start() {
+	size_t open_ports = 0;
+	for (auto& entry : m_pimpl->snapshot()) {
+		if (*entry.port || entry.port->start(entry.port_name, entry.options)) {
+			open_ports++;
+		}
 	}
+	return open_ports;
+}
+
+void serialport_manager::stop() {
+	for (auto& entry : m_pimpl->snapshot()) {
+		entry.port->stop();
+	}
+}
+
+serialport_manager::stats serialport_manager::get_stats() const {
+	stats totals;
+	for (auto& entry : m_pimpl->snapshot()) {
+		const auto port_stats = entry.port->get_stats();
+		totals.rx_bytes += port_stats.rx_bytes;
+		totals.rx_reads += port_stats.rx_reads;
+		totals.tx_bytes += port_stats.tx_bytes;
+		totals.tx_messages += port_stats.tx_messages;
+		totals.tx_rejected += port_stats.tx_rejected;
+		totals.errors += port_stats.errors;
+		totals.recoveries += port_stats.recoveries;
+		totals.ports++;
+		if (*entry.port) {
+			totals.open_ports++;
+		}
+	}
+	return totals;
+}
+
+size_t serialport_manager::size() const {
+	std::lock_guard<std::mutex> lck(m_pimpl->mutex);
+	return m_pimpl->ports.size();
+}
+
+size_t serialport_manager::num_threads() const {
+	return m_pimpl->threads.size();
 }
@@ -8,14 +8,19 @@
 #include <system_error>
 #include "core0/types.h"
 #include "core0/api_export.h"
+#include "core1/shared_buffer.h"
+
+class serialport_manager;
 
 // A self explanatory class to manage a serial port.
 class serialport {
 public:
 	// Call back for async usage.
 	using cb_on_recv = std::function<void(const u8* data_ptr, const size_t data_len, const std::error_code& e)>;
+	using cb_on_recv_buffer = std::function<void(core1::memory::shared_buffer data, const std::error_code& e)>;
 	using cb_on_recoverd = std::function<void()>;
 	using cb_on_async_send = std::function<void(const std::error_code& e, const size_t data_len)>;
+	using post_function = std::function<void(std::function<void()>)>;
 
 	// Options for configuration.
 	struct options {
@@ -43,6 +48,30 @@ public:
 		flow_control flow_control = flow_control::none;
 		bool auto_recover = true;
 		cb_on_recoverd on_recoverd = nullptr;
+		// Runs the receive and send call backs (e.g. core0::executor::poster()), empty to run them on the port thread.
+		// Received data is handed over in its receive buffer, without a copy.
+		post_function post = nullptr;
+		// Receive buffer size. Reads which fill the buffer grow it up to read_size_max, it shrinks back when traffic drops
+		// (read_size_max = read_size for a fixed size).
+		size_t read_size = 256;
+		size_t read_size_max = 64 << 10;
+		// Async sending backpressure: async_send fails once this many messages / bytes are queued (0 for no limit).
+		// A single message larger than tx_max_bytes is still accepted when nothing else is queued.
+		size_t tx_max_messages = 1024;
+		size_t tx_max_bytes = 1 << 20;
+		// Queued messages are written out together, up to this many per gathered write.
+		size_t tx_max_coalesce = 64;
+	};
+
+	// Counters since the port was created.
+	struct stats {
+		u64 rx_bytes = 0;
+		u64 rx_reads = 0;
+		u64 tx_bytes = 0;
+		u64 tx_messages = 0;
+		u64 tx_rejected = 0;     // Refused by the async sending backpressure.
+		u64 errors = 0;          // Failed reads and writes.
+		u64 recoveries = 0;      // Reopened by auto_recover.
 	};
 
 	API_EXPORT serialport();
@@ -59,14 +88,22 @@ public:
 	// Under Linux port_name would usually look like: "/dev/ttyS0"
 	// where 0 can be replaced with different serial port nodes.
 	// If permission is denied: sudo chmod o+rw /dev/ttyS0
+	// Starting a port which is recovering (auto_recover) stops the recovery first. A stand alone port (not on a manager)
+	// cannot be restarted from its own call back.
 	bool API_EXPORT start(const std::string& port_name, const options& options);
 
-	// Stops listening on the serial port and closes it.
+	// Stops listening on the serial port and closes it. Can be called from any thread, including the call backs of this
+	// or of another port (on the manager threads too). From its own call back it returns without waiting for the port's
+	// handlers to finish, a port must not be destroyed (or removed from its manager) from its own call back.
 	void API_EXPORT stop();
 
 	// Sets a call back handler to be called when data is received.
 	void API_EXPORT set_cb_on_recv(const cb_on_recv& on_recv);
 
+	// Same, but the consumer owns the receive buffer: it can keep it or queue it to another thread without copying,
+	// the buffer goes back to a pool once the last reference is gone. Takes precedence over set_cb_on_recv.
+	void API_EXPORT set_cb_on_recv_buffer(const cb_on_recv_buffer& on_recv);
+
 	// Synchronous sending (returns upon completion).
 	size_t API_EXPORT send(const std::string& buf);
 	size_t API_EXPORT send(const char* buf, const size_t& size);
@@ -79,11 +116,75 @@ public:
 	//   port.async_send(to_send, to_send->size(), [](const std::error_code e, const size_t len){
 	//   	printf("sent %d bytes", len);
 	//   });
-	// This has no internal buffering and will drop a new message if the current one did not finish sending.
+	// Messages are queued (from any thread) and written in order, the ones which pile up while a write is in progress
+	// go out together in one gathered write. on_send is called for each message once it was written.
+	// Returns false (and calls on_send with no_buffer_space) if the queue is over options.tx_max_messages / tx_max_bytes.
+	// Messages still queued when the port stops are failed with operation_canceled.
 	bool API_EXPORT async_send(std::shared_ptr<std::vector<u8>> buf, const size_t& size, const cb_on_async_send& on_send);
 	bool API_EXPORT async_send(std::shared_ptr<std::string> buf, const cb_on_async_send& on_send);
 
+	// Can be called from any thread.
+	stats API_EXPORT get_stats() const;
+
+private:
+	friend class serialport_manager;
+	// A port which runs on the io_context of a manager.
+	explicit serialport(serialport_manager& manager);
+
+	struct impl;
+	std::unique_ptr<impl> m_pimpl;
+};
+
+// Runs many serial ports on one io_context serviced by a small pool of threads, instead of a thread per port.
+// Each port still runs its handlers one at a time (on a strand), so a port behaves the same as a stand alone one,
+// and its call backs run on one of the pool threads.
+// Example use:
+// serialport_manager manager;                                 // one thread per cpu
+// for (auto& name : names) manager.add(name, serialport::options(115200)).set_cb_on_recv(on_recv);
+// manager.start();
+// auto stats = manager.get_stats();
+class serialport_manager {
+public:
+	struct options {
+		options() {}
+		unsigned num_threads = 0;                // 0 for one thread per cpu.
+		std::vector<std::vector<int>> cpus;      // Thread ii is pinned to cpus[ii % cpus.size()], empty for no pinning.
+		std::string name;                        // Threads are named <name><ii>.
+	};
+
+	// Totals across the ports.
+	struct stats : serialport::stats {
+		size_t ports = 0;
+		size_t open_ports = 0;
+	};
+
+	API_EXPORT explicit serialport_manager(const options& options = {});
+	// Stops and destroys the ports, then joins the threads.
+	API_EXPORT ~serialport_manager();
+
+	// Disable copy constructors.
+	serialport_manager(const serialport_manager&) = delete;
+	serialport_manager& operator=(const serialport_manager&) = delete;
+
+	// Adds a port (it is started by start(), or by its own start()), the manager owns it.
+	API_EXPORT serialport& add(const std::string& port_name, const serialport::options& options);
+	// The manager methods can be called from the port call backs (see serialport::stop()).
+	// Stops and destroys a port, returns false if there is no such port.
+	bool API_EXPORT remove(const std::string& port_name);
+	// nullptr if there is no such port.
+	API_EXPORT serialport* find(const std::string& port_name);
+
+	// Starts the ports which are not open, returns how many are open afterwards.
+	size_t API_EXPORT start();
+	// Stops all ports.
+	void API_EXPORT stop();
+
+	stats API_EXPORT get_stats() const;
+	size_t API_EXPORT size() const;
+	size_t API_EXPORT num_threads() const;
+
 private:
+	friend class serialport;
 	struct impl;
 	std::unique_ptr<impl> m_pimpl;
 };